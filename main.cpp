@@ -4,15 +4,67 @@
  * заменяя их содержимым включаемых файлов
  */
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
-#include <regex>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifdef __APPLE__
+#include <sys/mount.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#include <sys/socket.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
 using namespace std;
 using filesystem::path;
 
@@ -22,248 +74,7469 @@ path operator""_p(const char* data, size_t sz) {
 }
 
 /**
- * Рекурсивно обрабатывает файл, разворачивая директивы #include
- * 
- * @param current_file - текущий обрабатываемый файл
- * @param output - выходной поток для записи результата
- * @param include_dirs - список директорий для поиска заголовочных файлов
- * @param source_file - исходный файл (для отображения ошибок)
- * @param source_line - номер строки в исходном файле (для отображения ошибок)
- * @return true в случае успеха, false при ошибке
+ * Способ чтения входного файла
  */
-bool ProcessInclude(const path &current_file, ofstream &output, const vector<path> &include_dirs, const path &source_file = "", int source_line = 0) {
-    // Попытка открыть текущий файл для чтения
-    ifstream input(current_file);
-    if (!input.is_open()) {
-        // Вывод ошибки, если файл не найден
-        if (!source_file.empty()) {
-            cout << "unknown include file " << current_file.filename().string() 
-                 << " at file " << source_file.string() 
-                 << " at line " << source_line << endl;
-        }
-        return false;
+enum class ReadMethod {
+    kRead,   // read() в буфер: дешевле mmap для маленьких файлов и надёжнее на сетевых ФС
+    kMmap,   // отображение в память: без копирования для больших файлов
+    kDirect, // read() с O_DIRECT в обход страничного кэша для очень больших файлов
+};
+
+constexpr size_t kReadMethodCount = 3;
+
+/**
+ * Возвращает имя способа чтения для вывода
+ */
+const char* GetReadMethodName(ReadMethod method) {
+    switch (method) {
+        case ReadMethod::kRead:
+            return "read";
+        case ReadMethod::kMmap:
+            return "mmap";
+        case ReadMethod::kDirect:
+            return "direct";
     }
+    return "?";
+}
 
-    // Регулярные выражения для поиска директив include
-    // Локальные заголовки: #include "file.h"
-    static const regex include_local(R"/(\s*#\s*include\s*"([^"]*)"\s*)/");
-    // Системные заголовки: #include <file.h>
-    static const regex include_global(R"/(\s*#\s*include\s*<([^>]*)>\s*)/");
-    
-    string line;
-    int line_number = 0;
-    bool success = true;
+/**
+ * Пороги выбора способа чтения файла по его размеру
+ * Значения по умолчанию подходят для локального диска; точнее их
+ * подбирает калибровка (--calibrate-io)
+ */
+struct IoPolicy {
+    size_t mmap_threshold = 256 * 1024; // файлы от этого размера отображаются в память
+    size_t direct_threshold = 0;        // файлы от этого размера читаются с O_DIRECT; 0 - никогда
 
-    // Обработка файла построчно
-    while (getline(input, line)) {
-        line_number++;
-        smatch match;
-
-        // Обработка локальных заголовков (#include "...")
-        if (regex_search(line, match, include_local)) {
-            path include_path = match[1].str(); // Извлекаем имя файла
-            path current_dir = current_file.parent_path(); // Директория текущего файла
-            path full_path = current_dir / include_path; // Полный путь к включаемому файлу
-
-            // Поиск файла сначала относительно текущей директории
-            if (!filesystem::exists(full_path)) {
-                bool found = false;
-
-                // Поиск в директориях include
-                for (const auto &dir : include_dirs) {
-                    full_path = dir / include_path;
-                    if (filesystem::exists(full_path)) {
-                        found = true;
-                        break;
-                    }
-                }
+    /**
+     * Выбирает способ чтения файла
+     *
+     * @param size - размер файла
+     * @param network - файл на сетевой ФС, где отображение в память медленно
+     *                  и ненадёжно при изменении файла на другом узле
+     */
+    ReadMethod Choose(size_t size, bool network) const {
+        if (direct_threshold > 0 && size >= direct_threshold) {
+            return ReadMethod::kDirect;
+        }
+        if (!network && size > 0 && size >= mmap_threshold) {
+            return ReadMethod::kMmap;
+        }
+        return ReadMethod::kRead;
+    }
 
-                // Ошибка, если файл не найден
-                if (!found) {
-                    cout << "unknown include file " << include_path.string() 
-                         << " at file " << current_file.string() 
-                         << " at line " << line_number << endl;
-                    success = false;
-                    break;
-                }
-            }
+    /**
+     * Политика, всегда выбирающая указанный способ (для калибровки)
+     */
+    static IoPolicy Forced(ReadMethod method) {
+        IoPolicy policy;
+        policy.mmap_threshold = method == ReadMethod::kMmap ? 0 : numeric_limits<size_t>::max();
+        policy.direct_threshold = method == ReadMethod::kDirect ? 1 : 0;
+        return policy;
+    }
 
-            // Рекурсивная обработка найденного файла
-            if (!ProcessInclude(full_path, output, include_dirs, current_file, line_number)) {
-                success = false;
-                break;
+    /**
+     * Загружает пороги, сохранённые Save
+     *
+     * @return политика или nullopt, если файла нет или он повреждён
+     */
+    static optional<IoPolicy> Load(const path& file) {
+        ifstream in(file);
+        IoPolicy policy;
+        string name;
+        size_t value;
+        int found = 0;
+        while (in >> name >> value) {
+            if (name == "mmap_threshold") {
+                policy.mmap_threshold = value;
+                ++found;
+            } else if (name == "direct_threshold") {
+                policy.direct_threshold = value;
+                ++found;
             }
-        } 
-        // Обработка системных заголовков (#include <...>)
-        else if (regex_search(line, match, include_global)) {
-            path include_path = match[1].str(); // Извлекаем имя файла
-            bool found = false;
-            path full_path;
+        }
+        return found == 2 ? optional<IoPolicy>(policy) : nullopt;
+    }
 
-            // Поиск только в директориях include (не относительно текущей)
-            for (const auto &dir : include_dirs) {
-                full_path = dir / include_path;
-                if (filesystem::exists(full_path)) {
-                    found = true;
-                    break;
-                }
-            }
+    bool Save(const path& file) const {
+        ofstream out(file);
+        out << "mmap_threshold " << mmap_threshold << "\ndirect_threshold " << direct_threshold << '\n';
+        return static_cast<bool>(out);
+    }
 
-            // Ошибка, если файл не найден
-            if (!found) {
-                cout << "unknown include file " << include_path.string() 
-                     << " at file " << current_file.string() 
-                     << " at line " << line_number << endl;
-                success = false;
-                break;
-            }
+    /**
+     * Политика, с которой создаются PreprocessOptions: встроенные пороги или
+     * загруженные из файла калибровки (SetDefault). Меняется только при
+     * запуске программы, до начала обработки
+     */
+    static IoPolicy GetDefault() {
+        return DefaultStorage();
+    }
 
-            // Рекурсивная обработка найденного файла
-            if (!ProcessInclude(full_path, output, include_dirs, current_file, line_number)) {
-                success = false;
-                break;
-            }
-        } 
-        // Если строка не содержит директиву include, копируем её как есть
-        else {
-            output << line << endl;
+    static void SetDefault(const IoPolicy& policy) {
+        DefaultStorage() = policy;
+    }
+
+private:
+    static IoPolicy& DefaultStorage() {
+        static IoPolicy policy;
+        return policy;
+    }
+};
+
+/**
+ * Делает пороги из файла калибровки (--calibrate-io) политикой чтения по умолчанию
+ *
+ * @param file - файл калибровки
+ * @param required - отсутствие файла считается ошибкой; иначе остаются встроенные пороги
+ * @return true, если файл загружен или необязательного файла нет
+ */
+bool LoadIoCalibration(const path& file, bool required) {
+    optional<IoPolicy> policy = IoPolicy::Load(file);
+    if (!policy) {
+        if (required || filesystem::exists(file)) {
+            cout << "Ошибка: Не удалось загрузить калибровку чтения: " << file.string() << endl;
+            return false;
         }
+        return true;
     }
+    IoPolicy::SetDefault(*policy);
+    cout << "io policy from " << file.string() << ": mmap_threshold=" << policy->mmap_threshold
+         << " direct_threshold=" << policy->direct_threshold << endl;
+    return true;
+}
 
-    return success;
+#if defined(__unix__) || defined(__APPLE__)
+/**
+ * Время последнего изменения из результата stat в наносекундах
+ */
+int64_t GetMtime(const struct stat& st) {
+#ifdef __APPLE__
+    const timespec& time = st.st_mtimespec;
+#else
+    const timespec& time = st.st_mtim;
+#endif
+    return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
 }
+#endif
 
 /**
- * Главная функция препроцессинга
- * Обрабатывает входной файл и создаёт выходной файл с развёрнутыми include
- * 
- * @param input_file - путь к входному файлу
- * @param output_file - путь к выходному файлу
- * @param include_dirs - список директорий для поиска заголовочных файлов
- * @return true в случае успеха, false при ошибке
+ * Возвращает время последнего изменения файла или директории
+ *
+ * @param p - путь к файлу или директории
+ * @return метка времени (на Unix - наносекунды, иначе единицы file_time_type)
+ *         или -1, если пути нет
  */
-bool Preprocess(const path& input_file, const path& output_file,
-                const vector<path>& include_dirs) {
-    // Проверка возможности открытия входного файла
-    ifstream input(input_file);
-    if (!input.is_open()) {
-        cout << "Ошибка: Не удалось открыть входной файл: " << input_file.string() << endl;
-        return false;
+int64_t GetMtime(const path& p) {
+#if defined(__unix__) || defined(__APPLE__)
+    struct stat st;
+    return stat(p.c_str(), &st) == 0 ? GetMtime(st) : -1;
+#else
+    error_code err;
+    auto time = filesystem::last_write_time(p, err);
+    return err ? -1 : static_cast<int64_t>(time.time_since_epoch().count());
+#endif
+}
+
+/**
+ * Размер и время изменения файла: по ним проверяется, что файл не менялся
+ */
+struct FileStamp {
+    uintmax_t size = 0;
+    int64_t mtime = -1;
+
+    bool operator==(const FileStamp& other) const {
+        return size == other.size && mtime == other.mtime;
     }
 
-    // Проверка возможности создания выходного файла
-    ofstream output(output_file);
-    if (!output.is_open()) {
-        cout << "Ошибка: Не удалось открыть выходной файл: " << output_file.string() << endl;
-        return false;
+    bool operator!=(const FileStamp& other) const {
+        return !(*this == other);
     }
+};
 
-    // Запуск обработки файла
-    return ProcessInclude(input_file, output, include_dirs);
+#if defined(__unix__) || defined(__APPLE__)
+FileStamp GetFileStamp(const struct stat& st) {
+    return {static_cast<uintmax_t>(st.st_size), GetMtime(st)};
 }
+#endif
 
 /**
- * Вспомогательная функция для чтения всего содержимого файла в строку
- * 
- * @param file - путь к файлу
- * @return содержимое файла в виде строки
+ * Текущие размер и время изменения файла; для отсутствующего файла mtime = -1
  */
-string GetFileContents(const string& file) {
-    ifstream stream(file);
-    return {istreambuf_iterator<char>(stream), istreambuf_iterator<char>()};
+FileStamp GetFileStamp(const path& file) {
+#if defined(__unix__) || defined(__APPLE__)
+    struct stat st;
+    return stat(file.c_str(), &st) == 0 ? GetFileStamp(st) : FileStamp{};
+#else
+    error_code err;
+    FileStamp stamp;
+    stamp.size = filesystem::file_size(file, err);
+    stamp.mtime = err ? -1 : GetMtime(file);
+    return stamp;
+#endif
 }
 
 /**
- * Функция тестирования препроцессора
- * Создаёт тестовую файловую структуру и проверяет корректность работы
+ * Прочитанный файл вместе с отметкой версии, которая была прочитана
  */
-void Test() {
-    error_code err;
-    
-    // Очистка и создание тестовой структуры директорий
-    filesystem::remove_all("sources"_p, err);
-    filesystem::create_directories("sources"_p / "include2"_p / "lib"_p, err);
-    filesystem::create_directories("sources"_p / "include1"_p, err);
-    filesystem::create_directories("sources"_p / "dir1"_p / "subdir"_p, err);
+struct StampedFile {
+    path file;
+    FileStamp stamp;
+};
 
-    // Создание тестового основного файла sources/a.cpp
+#if defined(__unix__) || defined(__APPLE__)
+/**
+ * Проверяет, лежит ли открытый файл на сетевой ФС
+ * Тип ФС запоминается для каждого устройства, поэтому statfs вызывается
+ * один раз на устройство
+ */
+bool IsNetworkFilesystem(int fd, dev_t device) {
+    static mutex cache_mutex;
+    static unordered_map<dev_t, bool> cache;
     {
-        ofstream file("sources/a.cpp");
-        file << "// this comment before include\n"
-                "#include \"dir1/b.h\"\n"
-                "// text between b.h and c.h\n"
-                "#include \"dir1/d.h\"\n"
-                "\n"
-                "int SayHello() {\n"
-                "    cout << \"hello, world!\" << endl;\n"
-                "#   include<dummy.txt>\n" // Этот include должен вызвать ошибку
-                "}\n"s;
+        lock_guard lock(cache_mutex);
+        auto it = cache.find(device);
+        if (it != cache.end()) {
+            return it->second;
+        }
     }
-    
-    // Создание тестового заголовка sources/dir1/b.h
-    {
-        ofstream file("sources/dir1/b.h");
-        file << "// text from b.h before include\n"
-                "#include \"subdir/c.h\"\n"
-                "// text from b.h after include"s;
+    bool network = false;
+#ifdef __linux__
+    struct statfs fs;
+    if (fstatfs(fd, &fs) == 0) {
+        switch (static_cast<uint32_t>(fs.f_type)) {
+            case 0x6969:     // NFS
+            case 0x517B:     // SMB
+            case 0xFF534D42: // CIFS
+            case 0xFE534D42: // SMB2
+            case 0x01021997: // 9P
+            case 0x00C36400: // Ceph
+            case 0x65735546: // FUSE (sshfs и подобные)
+                network = true;
+                break;
+        }
     }
-    
-    // Создание тестового заголовка sources/dir1/subdir/c.h
-    {
-        ofstream file("sources/dir1/subdir/c.h");
-        file << "// text from c.h before include\n"
-                "#include <std1.h>\n"
-                "// text from c.h after include\n"s;
+#elif defined(__APPLE__)
+    struct statfs fs;
+    if (fstatfs(fd, &fs) == 0) {
+        network = (fs.f_flags & MNT_LOCAL) == 0;
     }
-    
-    // Создание тестового заголовка sources/dir1/d.h
-    {
-        ofstream file("sources/dir1/d.h");
-        file << "// text from d.h before include\n"
-                "#include \"lib/std2.h\"\n"
-                "// text from d.h after include\n"s;
+#else
+    (void)fd;
+#endif
+    lock_guard lock(cache_mutex);
+    cache[device] = network;
+    return network;
+}
+#endif
+
+/**
+ * Содержимое файла только для чтения
+ * Способ чтения (read, mmap или O_DIRECT) выбирается по размеру файла и
+ * типу ФС согласно IoPolicy. На системах без mmap содержимое читается в
+ * строку целиком
+ */
+class MappedFile {
+public:
+    /**
+     * @param keep_descriptor - не закрывать дескриптор обычного файла после
+     *                          чтения (см. Descriptor)
+     */
+    explicit MappedFile(const path& file, const IoPolicy& policy = {}, bool keep_descriptor = false) {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            const size_t size = static_cast<size_t>(st.st_size);
+            stamp_ = GetFileStamp(st);
+            method_ = policy.Choose(size, IsNetworkFilesystem(fd, st.st_dev));
+            if (method_ == ReadMethod::kDirect && !ReadDirect(fd, size)) {
+                method_ = ReadMethod::kRead;
+            }
+            if (method_ == ReadMethod::kMmap) {
+                void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED) {
+                    data_ = static_cast<const char*>(addr);
+                    size_ = size;
+                    mapped_ = true;
+                } else {
+                    method_ = ReadMethod::kRead;
+                }
+            }
+            if (method_ == ReadMethod::kRead) {
+                // Размер известен заранее, поэтому хватает одного вызова read.
+                // Буфер не заполняется нулями: read всё равно его перезапишет
+                raw_buffer_.reset(new char[size]);
+                size_t filled = 0;
+                while (filled < size) {
+                    ssize_t n = read(fd, raw_buffer_.get() + filled, size - filled);
+                    if (n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (n <= 0) {
+                        break;
+                    }
+                    filled += static_cast<size_t>(n);
+                }
+                data_ = raw_buffer_.get();
+                size_ = filled;
+            }
+            // С O_DIRECT читать дескриптор можно только выровненными блоками
+            if (keep_descriptor && method_ != ReadMethod::kDirect) {
+                fd_ = fd;
+            }
+        } else {
+            // Каналы и устройства читаются до конца
+            char chunk[16 * 1024];
+            ssize_t n;
+            while ((n = read(fd, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR)) {
+                buffer_.append(chunk, static_cast<size_t>(max<ssize_t>(n, 0)));
+            }
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+        }
+        is_open_ = true;
+        if (fd_ != fd) {
+            close(fd);
+        }
+#else
+        (void)policy;
+        (void)keep_descriptor;
+        stamp_ = GetFileStamp(file);
+        ifstream stream(file, ios::binary);
+        if (stream.is_open()) {
+            buffer_.assign(istreambuf_iterator<char>(stream), istreambuf_iterator<char>());
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+            is_open_ = true;
+        }
+#endif
     }
-    
-    // Создание системного заголовка sources/include1/std1.h
-    {
-        ofstream file("sources/include1/std1.h");
-        file << "// std1\n"s;
+
+    ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapped_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+#endif
     }
-    
-    // Создание системного заголовка sources/include2/lib/std2.h
-    {
-        ofstream file("sources/include2/lib/std2.h");
-        file << "// std2\n"s;
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool IsOpen() const {
+        return is_open_;
     }
 
-    // Запуск препроцессинга (ожидается неудача из-за dummy.txt)
-    assert(!Preprocess("sources"_p / "a.cpp"_p, "sources"_p / "a.in"_p,
-                       {"sources"_p / "include1"_p, "sources"_p / "include2"_p}));
+    string_view Data() const {
+        return {data_, size_};
+    }
 
-    // Ожидаемый результат после успешного препроцессинга
-    ostringstream test_out;
-    test_out << "// this comment before include\n"
-                "// text from b.h before include\n"
-                "// text from c.h before include\n"
-                "// std1\n"
-                "// text from c.h after include\n"
-                "// text from b.h after include\n"
-                "// text between b.h and c.h\n"
-                "// text from d.h before include\n"
-                "// std2\n"
-                "// text from d.h after include\n"
-                "\n"
-                "int SayHello() {\n"
-                "    cout << \"hello, world!\" << endl;\n"s;
+    /**
+     * Способ, которым файл был прочитан
+     */
+    ReadMethod Method() const {
+        return method_;
+    }
 
-    // Проверка корректности результата
-    assert(GetFileContents("sources/a.in"s) == test_out.str());
+    /**
+     * Размер и время изменения прочитанной версии файла (по fstat открытого
+     * дескриптора, до чтения): если файл меняется во время чтения, отметка
+     * уже не совпадёт с текущей, и результат не будет принят за свежий.
+     * У каналов и устройств отметка пустая
+     */
+    FileStamp Stamp() const {
+        return stamp_;
+    }
+
+    /**
+     * Открытый дескриптор прочитанного файла, если он сохранён (keep_descriptor);
+     * иначе -1. У каналов, устройств и файлов, прочитанных с O_DIRECT,
+     * дескриптор не сохраняется
+     */
+    int Descriptor() const {
+        return fd_;
+    }
+
+private:
+#if defined(__unix__) || defined(__APPLE__)
+    static constexpr size_t kDirectAlignment = 4096;
+
+    // Читает файл в обход страничного кэша. O_DIRECT требует выровненных
+    // буфера и длины, поэтому буфер берётся с запасом и выравнивается внутри;
+    // нулями он не заполняется. Если ФС не поддерживает O_DIRECT, возвращает false
+    bool ReadDirect(int fd, size_t size) {
+#ifdef O_DIRECT
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) != 0) {
+            return false;
+        }
+        const size_t padded = (size + kDirectAlignment - 1) / kDirectAlignment * kDirectAlignment;
+        raw_buffer_.reset(new char[padded + kDirectAlignment]);
+        char* aligned = raw_buffer_.get()
+                        + (kDirectAlignment - reinterpret_cast<uintptr_t>(raw_buffer_.get()) % kDirectAlignment)
+                              % kDirectAlignment;
+        size_t filled = 0;
+        bool ok = true;
+        while (filled < size) {
+            ssize_t n = read(fd, aligned + filled, padded - filled);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                ok = n == 0;
+                break;
+            }
+            filled += static_cast<size_t>(n);
+        }
+        fcntl(fd, F_SETFL, flags);
+        if (!ok) {
+            raw_buffer_.reset();
+            lseek(fd, 0, SEEK_SET);
+            return false;
+        }
+        data_ = aligned;
+        size_ = min(filled, size);
+        return true;
+#else
+        (void)fd;
+        (void)size;
+        return false;
+#endif
+    }
+#endif
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool is_open_ = false;
+    bool mapped_ = false;
+    int fd_ = -1; // сохранённый дескриптор (keep_descriptor)
+    ReadMethod method_ = ReadMethod::kRead;
+    FileStamp stamp_;
+    string buffer_;                 // содержимое каналов и устройств
+    unique_ptr<char[]> raw_buffer_; // содержимое файла известного размера (read и O_DIRECT)
+};
+
+
+/**
+ * Директива #include, найденная в файле
+ */
+struct IncludeDirective {
+    int line = 0;       // номер строки, начиная с 1
+    bool local = false; // true для "file.h", false для <file.h>
+    string name;        // имя файла из директивы
+};
+
+/**
+ * Последовательное чтение двоичных данных с проверкой границ
+ * При выходе за границы ok становится false, а чтения возвращают пустые значения
+ */
+struct BinaryReader {
+    string_view data;
+    size_t pos = 0;
+    bool ok = true;
+
+    uint32_t U32() {
+        uint32_t value = 0;
+        Read(&value, sizeof(value));
+        return value;
+    }
+
+    int64_t I64() {
+        int64_t value = 0;
+        Read(&value, sizeof(value));
+        return value;
+    }
+
+    string String() {
+        uint32_t size = U32();
+        if (!ok || data.size() - pos < size) {
+            ok = false;
+            return {};
+        }
+        string value(data.substr(pos, size));
+        pos += size;
+        return value;
+    }
+
+    void Read(void* dst, size_t size) {
+        if (!ok || data.size() - pos < size) {
+            ok = false;
+            return;
+        }
+        memcpy(dst, data.data() + pos, size);
+        pos += size;
+    }
+};
+
+// Запись двоичных данных в формате, который читает BinaryReader
+void WriteU32(ostream& out, uint32_t value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteI64(ostream& out, int64_t value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteString(ostream& out, const string& value) {
+    WriteU32(out, static_cast<uint32_t>(value.size()));
+    out.write(value.data(), static_cast<streamsize>(value.size()));
 }
 
 /**
- * Главная функция программы
- * Запускает тестирование препроцессора
+ * Сводка директив #include просмотренного файла
+ * Поля директив хранятся параллельными массивами (начала и концы строк,
+ * номера строк, концы имён, виды директив, затем сами имена) в одном блоке
+ * памяти, поэтому повторное разворачивание файла по сводке читает несколько
+ * подряд идущих строк кэша, а текст между директивами копируется целиком
+ */
+class DirectiveSummary {
+public:
+    // Директива для построения сводки
+    struct Record {
+        uint32_t begin; // смещение начала строки директивы
+        uint32_t end;   // смещение конца строки (символа '\n' или конца файла)
+        IncludeDirective directive;
+    };
+
+    DirectiveSummary() = default;
+
+    explicit DirectiveSummary(const vector<Record>& records) : count_(records.size()) {
+        size_t names_size = 0;
+        for (const auto& record : records) {
+            names_size += record.directive.name.size();
+        }
+        block_ = make_unique<uint32_t[]>(kArrays * count_ + (count_ + names_size + 3) / 4);
+        char* kinds = Kinds();
+        uint32_t name_end = 0;
+        for (size_t i = 0; i < count_; ++i) {
+            const Record& record = records[i];
+            block_[i] = record.begin;
+            block_[count_ + i] = record.end;
+            block_[2 * count_ + i] = static_cast<uint32_t>(record.directive.line);
+            memcpy(kinds + count_ + name_end, record.directive.name.data(), record.directive.name.size());
+            name_end += static_cast<uint32_t>(record.directive.name.size());
+            block_[3 * count_ + i] = name_end;
+            kinds[i] = record.directive.local ? 1 : 0;
+        }
+    }
+
+    size_t Size() const {
+        return count_;
+    }
+
+    uint32_t Begin(size_t i) const {
+        return block_[i];
+    }
+
+    uint32_t End(size_t i) const {
+        return block_[count_ + i];
+    }
+
+    int Line(size_t i) const {
+        return static_cast<int>(block_[2 * count_ + i]);
+    }
+
+    bool IsLocal(size_t i) const {
+        return Kinds()[i] != 0;
+    }
+
+    string_view Name(size_t i) const {
+        uint32_t name_begin = i == 0 ? 0 : block_[3 * count_ + i - 1];
+        return string_view(Kinds() + count_ + name_begin, block_[3 * count_ + i] - name_begin);
+    }
+
+private:
+    static constexpr size_t kArrays = 4; // число массивов uint32_t перед видами и именами
+
+    char* Kinds() const {
+        return reinterpret_cast<char*>(block_.get() + kArrays * count_);
+    }
+
+    size_t count_ = 0;
+    unique_ptr<uint32_t[]> block_;
+};
+
+/**
+ * Кэш тёплого состояния препроцессора
+ * Хранит таблицу разрешения include и сводки директив по файлам (вместе
+ * они задают граф включений). Состояние можно сохранить в один файл-снимок
+ * и загрузить при следующем запуске. Записи снимка не проверяются при
+ * загрузке: каждая проверяется при первом обращении к ней
+ *
+ * Методы можно вызывать из нескольких потоков, кроме LoadSnapshot: он
+ * заменяет всё содержимое и не должен пересекаться с обработкой файлов
  */
-int main() {
+class IncludeCache {
+public:
+    IncludeCache() = default;
+    IncludeCache(const IncludeCache&) = delete;
+    IncludeCache& operator=(const IncludeCache&) = delete;
+
+    /**
+     * Возвращает номер набора директорий include, добавляя его при необходимости
+     * Результаты поиска зависят от набора директорий, поэтому номер входит в ключ
+     */
+    size_t GetDirSetId(const vector<path>& include_dirs) {
+        lock_guard lock(mutex_);
+        for (size_t i = 0; i < dir_sets_.size(); ++i) {
+            if (dir_sets_[i] == include_dirs) {
+                return i;
+            }
+        }
+        dir_sets_.push_back(include_dirs);
+        return dir_sets_.size() - 1;
+    }
+
+    /**
+     * Ключ поиска include: набор директорий, вид директивы, откуда и что ищем
+     * Для "file.h" результат зависит от директории текущего файла, для <file.h> - нет
+     */
+    static string GetResolutionKey(size_t dir_set_id, bool local, const path& current_dir, string_view name) {
+        return to_string(dir_set_id) + (local ? "\"" + current_dir.string() : "<"s) + '\n' + string(name);
+    }
+
+    /**
+     * Ищет ранее разрешённый include
+     *
+     * @param key - ключ поиска (набор директорий, вид директивы, откуда и что ищем)
+     * @return путь к найденному файлу или nullopt, если записи нет или она устарела
+     */
+    optional<path> FindResolved(const string& key) {
+        lock_guard lock(mutex_);
+        auto it = resolutions_.find(key);
+        if (it == resolutions_.end()) {
+            return nullopt;
+        }
+        Resolution& entry = it->second;
+        if (entry.checked_run != run_) {
+            entry.checked_run = run_;
+            entry.valid = true;
+            for (uint32_t stamp : entry.stamps) {
+                if (!IsStampValid(stamp)) {
+                    entry.valid = false;
+                    break;
+                }
+            }
+        }
+        if (!entry.valid) {
+            return nullopt;
+        }
+        return entry.file;
+    }
+
+    /**
+     * Запоминает результат поиска include
+     *
+     * @param key - ключ поиска
+     * @param file - найденный файл
+     * @param probed_dirs - директории, в которых проверялось наличие файла;
+     *                      изменение любой из них делает запись устаревшей
+     */
+    void AddResolved(const string& key, const path& file, const vector<path>& probed_dirs) {
+        lock_guard lock(mutex_);
+        Resolution entry;
+        entry.file = file;
+        entry.checked_run = run_;
+        entry.valid = true;
+        for (const auto& dir : probed_dirs) {
+            entry.stamps.push_back(GetFreshStamp(dir));
+        }
+        resolutions_[key] = move(entry);
+    }
+
+    /**
+     * Начинает новый запуск: записи, проверенные в прошлых запусках, при
+     * следующем обращении проверяются заново. Так изменения файлов и
+     * директорий между запусками на одном кэше не пропускаются
+     */
+    void StartRun() {
+        lock_guard lock(mutex_);
+        ++run_;
+    }
+
+    /**
+     * Возвращает сводку директив файла, если она есть и файл не менялся
+     * Сводка может быть заменена новой в следующем запуске, поэтому она
+     * возвращается во владение вызывающего и используется без блокировки
+     */
+    shared_ptr<const DirectiveSummary> FindSummary(const path& file) {
+        lock_guard lock(mutex_);
+        auto it = summaries_.find(file.string());
+        if (it == summaries_.end()) {
+            return nullptr;
+        }
+        Summary& entry = it->second;
+        if (entry.checked_run != run_) {
+            entry.checked_run = run_;
+            entry.valid = entry.stamp == GetFileStamp(file);
+            ++checks_;
+        }
+        return entry.valid ? entry.directives : nullptr;
+    }
+
+    /**
+     * Возвращает сводку директив, если она построена по той же версии файла,
+     * что и прочитанный текст (stamp - отметка MappedFile этого текста)
+     * Файловая система не проверяется: отметка уже описывает прочитанное
+     */
+    shared_ptr<const DirectiveSummary> FindSummary(const path& file, const FileStamp& stamp) {
+        lock_guard lock(mutex_);
+        auto it = summaries_.find(file.string());
+        if (it == summaries_.end() || it->second.stamp != stamp) {
+            return nullptr;
+        }
+        return it->second.directives;
+    }
+
+    /**
+     * Обходит известный кэшу граф включений, начиная с файла file
+     * Обход обрывается на файлах без действующей сводки и на директивах без
+     * действующей записи поиска, поэтому результат может быть неполным
+     *
+     * @param dir_set_id - номер набора директорий include (GetDirSetId)
+     * @return файлы, которые, вероятно, прочитает обработка file (без него самого)
+     */
+    vector<path> CollectIncludes(const path& file, size_t dir_set_id) {
+        vector<path> result;
+        unordered_set<string> visited = {file.string()};
+        vector<path> pending = {file};
+        while (!pending.empty()) {
+            const path current = move(pending.back());
+            pending.pop_back();
+            shared_ptr<const DirectiveSummary> summary = FindSummary(current);
+            if (!summary) {
+                continue;
+            }
+            for (size_t i = 0; i < summary->Size(); ++i) {
+                optional<path> resolved = FindResolved(
+                    GetResolutionKey(dir_set_id, summary->IsLocal(i), current.parent_path(), summary->Name(i)));
+                if (resolved && visited.insert(resolved->string()).second) {
+                    result.push_back(*resolved);
+                    pending.push_back(move(*resolved));
+                }
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Запоминает сводку директив полностью просмотренного файла
+     *
+     * @param stamp - отметка версии файла, по тексту которой построена сводка
+     *                (MappedFile::Stamp), а не текущей: файл мог измениться
+     *                во время просмотра
+     * @param text_size - длина текста, к которому относятся смещения сводки;
+     *                    у перекодированного файла она отличается от размера файла
+     */
+    void AddSummary(const path& file, const FileStamp& stamp, const vector<DirectiveSummary::Record>& directives,
+                    uint64_t text_size) {
+        if (stamp.mtime < 0) {
+            return;
+        }
+        lock_guard lock(mutex_);
+        auto it = summaries_.find(file.string());
+        if (it != summaries_.end() && it->second.stamp == stamp) {
+            // Эту версию файла уже просмотрел другой поток
+            return;
+        }
+        Summary entry;
+        entry.stamp = stamp;
+        entry.text_size = text_size;
+        entry.directives = make_shared<const DirectiveSummary>(directives);
+        // Совпадение отметки с текущим файлом проверит первый поиск по пути
+        entry.checked_run = 0;
+        summaries_[file.string()] = move(entry);
+    }
+
+    // Число записей кэша и проверок записей по файловой системе
+    struct Occupancy {
+        size_t resolutions = 0;
+        size_t summaries = 0;
+        size_t stamps = 0;
+        uint64_t checks = 0;
+    };
+
+    Occupancy GetOccupancy() const {
+        lock_guard lock(mutex_);
+        return {resolutions_.size(), summaries_.size(), stamps_.size(), checks_};
+    }
+
+    /**
+     * Сохраняет кэш в файл-снимок
+     * Снимок пишется во временный файл и затем атомарно заменяет прежний,
+     * поэтому сбой во время записи не портит предыдущий снимок
+     *
+     * @param file - путь к файлу снимка
+     * @return true в случае успеха, false при ошибке
+     */
+    bool SaveSnapshot(const path& file) const {
+        lock_guard lock(mutex_);
+        path tmp_file = file;
+        tmp_file += ".tmp";
+        {
+            ofstream out(tmp_file, ios::binary);
+            if (!out.is_open()) {
+                return false;
+            }
+            out.write(kSnapshotMagic, sizeof(kSnapshotMagic));
+
+            WriteU32(out, static_cast<uint32_t>(dir_sets_.size()));
+            for (const auto& dirs : dir_sets_) {
+                WriteU32(out, static_cast<uint32_t>(dirs.size()));
+                for (const auto& dir : dirs) {
+                    WriteString(out, dir.string());
+                }
+            }
+
+            WriteU32(out, static_cast<uint32_t>(stamps_.size()));
+            for (const auto& stamp : stamps_) {
+                WriteString(out, stamp.dir.string());
+                WriteI64(out, stamp.mtime);
+            }
+
+            // Устаревшие записи в снимок не попадают
+            uint32_t count = 0;
+            for (const auto& [key, entry] : resolutions_) {
+                count += (entry.checked_run == 0 || entry.valid) ? 1 : 0;
+            }
+            WriteU32(out, count);
+            for (const auto& [key, entry] : resolutions_) {
+                if (entry.checked_run != 0 && !entry.valid) {
+                    continue;
+                }
+                WriteString(out, key);
+                WriteString(out, entry.file.string());
+                WriteU32(out, static_cast<uint32_t>(entry.stamps.size()));
+                for (uint32_t stamp : entry.stamps) {
+                    WriteU32(out, stamp);
+                }
+            }
+
+            count = 0;
+            for (const auto& [key, entry] : summaries_) {
+                count += (entry.checked_run == 0 || entry.valid) ? 1 : 0;
+            }
+            WriteU32(out, count);
+            for (const auto& [key, entry] : summaries_) {
+                if (entry.checked_run != 0 && !entry.valid) {
+                    continue;
+                }
+                WriteString(out, key);
+                WriteI64(out, static_cast<int64_t>(entry.stamp.size));
+                WriteI64(out, entry.stamp.mtime);
+                WriteI64(out, static_cast<int64_t>(entry.text_size));
+                const DirectiveSummary& directives = *entry.directives;
+                WriteU32(out, static_cast<uint32_t>(directives.Size()));
+                for (size_t i = 0; i < directives.Size(); ++i) {
+                    WriteU32(out, directives.Begin(i));
+                    WriteU32(out, directives.End(i));
+                    WriteU32(out, static_cast<uint32_t>(directives.Line(i)));
+                    WriteU32(out, directives.IsLocal(i) ? 1 : 0);
+                    WriteString(out, string(directives.Name(i)));
+                }
+            }
+
+            if (!out) {
+                return false;
+            }
+        }
+        error_code err;
+        filesystem::rename(tmp_file, file, err);
+        return !err;
+    }
+
+    /**
+     * Загружает кэш из файла-снимка, заменяя текущее содержимое
+     *
+     * @param file - путь к файлу снимка
+     * @return true в случае успеха; при отсутствии или повреждении снимка
+     *         возвращается false, а кэш остаётся пустым
+     */
+    bool LoadSnapshot(const path& file) {
+        IncludeCache loaded;
+        TakeFrom(loaded);
+        MappedFile mapped(file);
+        if (!mapped.IsOpen()) {
+            return false;
+        }
+        BinaryReader reader{mapped.Data()};
+        if (reader.data.substr(0, sizeof(kSnapshotMagic)) != string_view(kSnapshotMagic, sizeof(kSnapshotMagic))) {
+            return false;
+        }
+        reader.pos = sizeof(kSnapshotMagic);
+
+        for (uint32_t i = 0, n = reader.U32(); reader.ok && i < n; ++i) {
+            vector<path> dirs;
+            for (uint32_t j = 0, m = reader.U32(); reader.ok && j < m; ++j) {
+                dirs.push_back(reader.String());
+            }
+            loaded.dir_sets_.push_back(move(dirs));
+        }
+        for (uint32_t i = 0, n = reader.U32(); reader.ok && i < n; ++i) {
+            DirStamp stamp;
+            stamp.dir = reader.String();
+            stamp.mtime = reader.I64();
+            loaded.stamp_index_[stamp.dir.string()] = static_cast<uint32_t>(loaded.stamps_.size());
+            loaded.stamps_.push_back(move(stamp));
+        }
+        for (uint32_t i = 0, n = reader.U32(); reader.ok && i < n; ++i) {
+            string key = reader.String();
+            Resolution entry;
+            entry.file = reader.String();
+            for (uint32_t j = 0, m = reader.U32(); reader.ok && j < m; ++j) {
+                uint32_t stamp = reader.U32();
+                reader.ok = reader.ok && stamp < loaded.stamps_.size();
+                entry.stamps.push_back(stamp);
+            }
+            loaded.resolutions_[move(key)] = move(entry);
+        }
+        for (uint32_t i = 0, n = reader.U32(); reader.ok && i < n; ++i) {
+            string key = reader.String();
+            Summary entry;
+            entry.stamp.size = static_cast<uintmax_t>(reader.I64());
+            entry.stamp.mtime = reader.I64();
+            entry.text_size = static_cast<uint64_t>(reader.I64());
+            vector<DirectiveSummary::Record> records;
+            for (uint32_t j = 0, m = reader.U32(); reader.ok && j < m; ++j) {
+                DirectiveSummary::Record record;
+                record.begin = reader.U32();
+                record.end = reader.U32();
+                record.directive.line = static_cast<int>(reader.U32());
+                record.directive.local = reader.U32() != 0;
+                record.directive.name = reader.String();
+                reader.ok = reader.ok && record.begin <= record.end && record.end <= entry.text_size;
+                records.push_back(move(record));
+            }
+            entry.directives = make_shared<const DirectiveSummary>(records);
+            loaded.summaries_[move(key)] = move(entry);
+        }
+        if (!reader.ok) {
+            return false;
+        }
+        TakeFrom(loaded);
+        return true;
+    }
+
+private:
+    static constexpr char kSnapshotMagic[8] = {'P', 'P', 'S', 'N', 'A', 'P', '0', '4'};
+
+    // Метка времени директории, от которой зависят результаты поиска.
+    // valid - результат проверки в запуске checked_run (0 - не проверялась)
+    struct DirStamp {
+        path dir;
+        int64_t mtime = -1;
+        uint64_t checked_run = 0;
+        bool valid = false;
+    };
+
+    struct Resolution {
+        path file;
+        vector<uint32_t> stamps; // индексы в stamps_
+        uint64_t checked_run = 0;
+        bool valid = false;
+    };
+
+    struct Summary {
+        FileStamp stamp;        // версия файла, по которой построена сводка
+        uint64_t text_size = 0; // длина текста, к которому относятся смещения
+        shared_ptr<const DirectiveSummary> directives;
+        uint64_t checked_run = 0;
+        bool valid = false;
+    };
+
+
+    // Заменяет содержимое кэша содержимым другого
+    void TakeFrom(IncludeCache& other) {
+        lock_guard lock(mutex_);
+        dir_sets_ = move(other.dir_sets_);
+        stamps_ = move(other.stamps_);
+        stamp_index_ = move(other.stamp_index_);
+        resolutions_ = move(other.resolutions_);
+        summaries_ = move(other.summaries_);
+    }
+
+    // Проверяет (один раз за запуск), что директория не менялась с момента записи
+    bool IsStampValid(uint32_t index) {
+        DirStamp& stamp = stamps_[index];
+        if (stamp.checked_run != run_) {
+            stamp.checked_run = run_;
+            stamp.valid = GetMtime(stamp.dir) == stamp.mtime;
+            ++checks_;
+        }
+        return stamp.valid;
+    }
+
+    // Возвращает метку директории с её текущим временем изменения.
+    // Устаревшая метка не обновляется на месте, а заменяется новой: на неё
+    // могут ссылаться ещё не проверенные записи, которые должны остаться устаревшими
+    uint32_t GetFreshStamp(const path& dir) {
+        auto it = stamp_index_.find(dir.string());
+        if (it != stamp_index_.end() && IsStampValid(it->second)) {
+            return it->second;
+        }
+        DirStamp stamp;
+        stamp.dir = dir;
+        stamp.mtime = GetMtime(dir);
+        stamp.checked_run = run_;
+        stamp.valid = true;
+        uint32_t index = static_cast<uint32_t>(stamps_.size());
+        stamps_.push_back(move(stamp));
+        stamp_index_[dir.string()] = index;
+        return index;
+    }
+
+    vector<vector<path>> dir_sets_;
+    vector<DirStamp> stamps_;
+    unordered_map<string, uint32_t> stamp_index_;
+    unordered_map<string, Resolution> resolutions_;
+    unordered_map<string, Summary> summaries_;
+    uint64_t run_ = 1; // номер текущего запуска (см. StartRun)
+    uint64_t checks_ = 0; // сколько раз метки и сводки проверялись по файловой системе
+    mutable mutex mutex_;
+};
+
+/**
+ * 64-битный хеш строки (FNV-1a с перемешиванием результата)
+ *
+ * @param data - строка
+ * @param seed - начальное значение, дающее независимые хеши одной строки
+ */
+uint64_t HashString(string_view data, uint64_t seed = 0) {
+    uint64_t hash = 14695981039346656037ull ^ seed;
+    for (char c : data) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Фильтр Блума относительных путей всех файлов и поддиректорий директории
+ * include. Отрицательный ответ точен: такого пути в директории нет, и
+ * проверять файловую систему не нужно
+ *
+ * Вместе с фильтром хранятся времена изменения всех поддиректорий. Новый
+ * файл меняет время изменения своей директории, поэтому для ответа о пути
+ * a/b/c.h достаточно убедиться, что не менялись директории "", a и a/b
+ */
+class DirectoryBloom {
+public:
+    /**
+     * Строит фильтр по текущему содержимому директории
+     * Если в директории есть ссылки на директории или недоступные
+     * поддиректории, фильтр помечается ненадёжным и не используется
+     */
+    static DirectoryBloom Build(const path& dir) {
+        DirectoryBloom bloom;
+        bloom.dir_ = dir;
+        bloom.stamps_[""] = GetMtime(dir);
+
+        vector<string> entries;
+        error_code err;
+        filesystem::recursive_directory_iterator it(dir, err), end;
+        for (; !err && it != end; it.increment(err)) {
+            const auto& entry = *it;
+            entries.push_back(entry.path().lexically_relative(dir).generic_string());
+            error_code entry_err;
+            if (entry.is_symlink(entry_err) && filesystem::is_directory(entry.path(), entry_err)) {
+                bloom.reliable_ = false;
+            } else if (entry.is_directory(entry_err)) {
+                bloom.stamps_[entries.back()] = GetMtime(entry.path());
+            }
+        }
+        if (err) {
+            bloom.reliable_ = false;
+        }
+
+        size_t words = max<size_t>(1, (entries.size() * kBitsPerEntry + 63) / 64);
+        bloom.bits_.assign(words, 0);
+        for (const auto& entry : entries) {
+            bloom.Add(entry);
+        }
+        return bloom;
+    }
+
+    /**
+     * Загружает фильтр, сохранённый SaveTo
+     *
+     * @return фильтр или nullopt, если файла нет, он повреждён или
+     *         построен для другой директории
+     */
+    static optional<DirectoryBloom> LoadFrom(const path& file, const path& dir) {
+        MappedFile mapped(file);
+        if (!mapped.IsOpen()) {
+            return nullopt;
+        }
+        BinaryReader reader{mapped.Data()};
+        DirectoryBloom bloom;
+        bloom.dir_ = dir;
+        if (reader.String() != kMagic || reader.String() != dir.string()) {
+            return nullopt;
+        }
+        bloom.reliable_ = reader.U32() != 0;
+        for (uint32_t i = 0, n = reader.U32(); reader.ok && i < n; ++i) {
+            string subdir = reader.String();
+            bloom.stamps_[move(subdir)] = reader.I64();
+        }
+        uint32_t words = reader.U32();
+        if (!reader.ok || words == 0 || words > (reader.data.size() - reader.pos) / sizeof(uint64_t)) {
+            return nullopt;
+        }
+        bloom.bits_.resize(words);
+        reader.Read(bloom.bits_.data(), words * sizeof(uint64_t));
+        if (!reader.ok) {
+            return nullopt;
+        }
+        return bloom;
+    }
+
+    bool SaveTo(const path& file) const {
+        path tmp_file = file;
+        tmp_file += ".tmp";
+        {
+            ofstream out(tmp_file, ios::binary);
+            WriteString(out, string(kMagic));
+            WriteString(out, dir_.string());
+            WriteU32(out, reliable_ ? 1 : 0);
+            WriteU32(out, static_cast<uint32_t>(stamps_.size()));
+            for (const auto& [subdir, mtime] : stamps_) {
+                WriteString(out, subdir);
+                WriteI64(out, mtime);
+            }
+            WriteU32(out, static_cast<uint32_t>(bits_.size()));
+            out.write(reinterpret_cast<const char*>(bits_.data()),
+                      static_cast<streamsize>(bits_.size() * sizeof(uint64_t)));
+            if (!out) {
+                return false;
+            }
+        }
+        error_code err;
+        filesystem::rename(tmp_file, file, err);
+        return !err;
+    }
+
+    bool IsReliable() const {
+        return reliable_;
+    }
+
+    /**
+     * Проверяет, что директории на пути к relative не менялись с построения
+     * фильтра. Каждая директория проверяется не больше одного раза за запуск
+     *
+     * @param relative - нормализованный относительный путь
+     * @param run - номер текущего запуска
+     */
+    bool IsFreshFor(const path& relative, uint64_t run) {
+        string prefix;
+        if (!IsStampFresh(prefix, run)) {
+            return false;
+        }
+        for (const auto& part : relative.parent_path()) {
+            prefix += (prefix.empty() ? "" : "/") + part.string();
+            if (stamps_.count(prefix) == 0) {
+                // При построении такой директории не было; её появление
+                // изменило бы время изменения уже проверенной родительской
+                break;
+            }
+            if (!IsStampFresh(prefix, run)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Может ли путь быть в директории; false - пути точно нет
+     */
+    bool MayContain(const string& relative) const {
+        const uint64_t bit_count = bits_.size() * 64;
+        uint64_t h1 = HashString(relative);
+        uint64_t h2 = HashString(relative, kSecondSeed) | 1;
+        for (size_t i = 0; i < kHashCount; ++i) {
+            uint64_t bit = (h1 + i * h2) % bit_count;
+            if ((bits_[bit / 64] & (1ull << (bit % 64))) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    static constexpr size_t kBitsPerEntry = 10;
+    static constexpr size_t kHashCount = 7; // оптимум для 10 бит на запись, ~1% ложных ответов
+    static constexpr uint64_t kSecondSeed = 0x9e3779b97f4a7c15ull;
+    static constexpr string_view kMagic = "PPBLOOM1"sv;
+
+    void Add(const string& relative) {
+        const uint64_t bit_count = bits_.size() * 64;
+        uint64_t h1 = HashString(relative);
+        uint64_t h2 = HashString(relative, kSecondSeed) | 1;
+        for (size_t i = 0; i < kHashCount; ++i) {
+            uint64_t bit = (h1 + i * h2) % bit_count;
+            bits_[bit / 64] |= 1ull << (bit % 64);
+        }
+    }
+
+    bool IsStampFresh(const string& subdir, uint64_t run) {
+        StampCheck& check = checked_[subdir];
+        if (check.run != run) {
+            check.run = run;
+            check.fresh = GetMtime(dir_ / subdir) == stamps_.at(subdir);
+        }
+        return check.fresh;
+    }
+
+    struct StampCheck {
+        uint64_t run = 0; // запуск, в котором была проверка; 0 - не проверялось
+        bool fresh = false;
+    };
+
+    path dir_;
+    bool reliable_ = true;
+    vector<uint64_t> bits_;
+    map<string, int64_t> stamps_;         // время изменения поддиректорий, "" - сама директория
+    unordered_map<string, StampCheck> checked_; // результаты проверки stamps_
+};
+
+/**
+ * Фильтры Блума директорий include, сохраняемые между запусками
+ * Фильтр директории загружается при первом обращении; устаревший или
+ * отсутствующий фильтр строится заново и сразу сохраняется
+ */
+class BloomIndex {
+public:
+    /**
+     * @param storage_dir - директория для сохранённых фильтров
+     */
+    explicit BloomIndex(path storage_dir) : storage_dir_(move(storage_dir)) {
+        error_code err;
+        filesystem::create_directories(storage_dir_, err);
+    }
+
+    /**
+     * Может ли файл include_path находиться в директории dir
+     *
+     * @return false, если файла там точно нет
+     */
+    bool MayContain(const path& dir, const path& include_path) {
+        path relative = include_path.lexically_normal();
+        if (relative.empty() || relative.is_absolute() || *relative.begin() == "..") {
+            return true;
+        }
+
+        lock_guard lock(mutex_);
+        DirectoryBloom* bloom = GetFilter(dir);
+        if (!bloom->IsFreshFor(relative, run_)) {
+            *bloom = DirectoryBloom::Build(dir);
+            bloom->SaveTo(GetStorageFile(dir));
+            ++rebuilds_;
+        }
+        return !bloom->IsReliable() || bloom->MayContain(relative.generic_string());
+    }
+
+    /**
+     * Начинает новый запуск: времена изменения директорий при следующем
+     * обращении проверяются заново, так что заголовки, добавленные между
+     * запусками на одном индексе, не теряются
+     */
+    void StartRun() {
+        lock_guard lock(mutex_);
+        ++run_;
+    }
+
+    /**
+     * Сколько раз фильтры строились заново
+     */
+    size_t GetRebuildCount() const {
+        lock_guard lock(mutex_);
+        return rebuilds_;
+    }
+
+private:
+    path GetStorageFile(const path& dir) const {
+        ostringstream name;
+        name << hex << HashString(filesystem::absolute(dir).lexically_normal().string()) << ".bloom";
+        return storage_dir_ / name.str();
+    }
+
+    DirectoryBloom* GetFilter(const path& dir) {
+        auto it = filters_.find(dir.string());
+        if (it != filters_.end()) {
+            return &it->second;
+        }
+        const path file = GetStorageFile(dir);
+        optional<DirectoryBloom> bloom = DirectoryBloom::LoadFrom(file, dir);
+        if (!bloom) {
+            bloom = DirectoryBloom::Build(dir);
+            bloom->SaveTo(file);
+            ++rebuilds_;
+        }
+        return &filters_.emplace(dir.string(), move(*bloom)).first->second;
+    }
+
+    path storage_dir_;
+    mutable mutex mutex_;
+    unordered_map<string, DirectoryBloom> filters_;
+    size_t rebuilds_ = 0;
+    uint64_t run_ = 1; // номер текущего запуска (см. StartRun)
+};
+
+/**
+ * Фазы обработки файла, для которых ведётся учёт счётчиков
+ */
+enum class Phase {
+    kRead,    // открытие файла и чтение строк
+    kScan,    // поиск директив в строках и вывод строк без директив
+    kResolve, // поиск включаемых файлов в директориях
+    kWrite,   // вывод директив, участков по сводке и сброс результата
+};
+
+constexpr size_t kPhaseCount = 4;
+
+const char* GetPhaseName(Phase phase) {
+    switch (phase) {
+        case Phase::kRead:
+            return "read";
+        case Phase::kScan:
+            return "scan";
+        case Phase::kResolve:
+            return "resolve";
+        case Phase::kWrite:
+            return "write";
+    }
+    return "?";
+}
+
+/**
+ * Значения счётчиков, накопленные за фазу
+ * Аппаратные счётчики остаются нулевыми, если они недоступны
+ */
+struct PhaseCounters {
+    uint64_t intervals = 0; // сколько раз фаза была активна
+    uint64_t nanoseconds = 0;
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t branch_misses = 0;
+    uint64_t llc_misses = 0;
+
+    PhaseCounters& operator+=(const PhaseCounters& other) {
+        intervals += other.intervals;
+        nanoseconds += other.nanoseconds;
+        cycles += other.cycles;
+        instructions += other.instructions;
+        branch_misses += other.branch_misses;
+        llc_misses += other.llc_misses;
+        return *this;
+    }
+};
+
+using PhaseTable = array<PhaseCounters, kPhaseCount>;
+
+/**
+ * Статистика препроцессинга: по каждому входному файлу и суммарно
+ */
+struct PreprocessStats {
+    struct Unit {
+        path input_file;
+        PhaseTable phases;
+    };
+
+    bool hw_counters = false; // были ли доступны аппаратные счётчики
+    PhaseTable total;
+    vector<Unit> units;
+    uint64_t files_opened = 0; // открытия входных и включаемых файлов
+    uint64_t probes = 0;       // проверки наличия файла при поиске include
+    array<uint64_t, kReadMethodCount> reads = {};      // прочитанные файлы по способу чтения
+    array<uint64_t, kReadMethodCount> read_bytes = {}; // их суммарный размер
+
+    // Использование директории поиска
+    struct DirUsage {
+        path dir;              // директория; пустой путь - директория включающего файла
+        uint64_t probes = 0;   // сколько раз в ней искали файл
+        uint64_t hits = 0;     // сколько раз файл был найден в ней
+        uint64_t shadowed = 0; // сколько раз файл в ней был, но найден раньше в другой
+    };
+    vector<DirUsage> dirs; // в порядке первого появления
+
+    /**
+     * Возвращает номер записи об использовании директории, добавляя её при необходимости
+     */
+    size_t GetDirUsageIndex(const path& dir) {
+        for (size_t i = 0; i < dirs.size(); ++i) {
+            if (dirs[i].dir == dir) {
+                return i;
+            }
+        }
+        dirs.push_back({dir});
+        return dirs.size() - 1;
+    }
+
+    /**
+     * Добавляет статистику другого запуска
+     */
+    void Merge(const PreprocessStats& other) {
+        hw_counters = hw_counters || other.hw_counters;
+        for (size_t i = 0; i < kPhaseCount; ++i) {
+            total[i] += other.total[i];
+        }
+        units.insert(units.end(), other.units.begin(), other.units.end());
+        files_opened += other.files_opened;
+        probes += other.probes;
+        for (size_t i = 0; i < kReadMethodCount; ++i) {
+            reads[i] += other.reads[i];
+            read_bytes[i] += other.read_bytes[i];
+        }
+        for (const auto& usage : other.dirs) {
+            DirUsage& target = dirs[GetDirUsageIndex(usage.dir)];
+            target.probes += usage.probes;
+            target.hits += usage.hits;
+            target.shadowed += usage.shadowed;
+        }
+    }
+
+    /**
+     * Копия статистики без данных по отдельным файлам
+     */
+    PreprocessStats GetTotals() const {
+        PreprocessStats totals;
+        totals.hw_counters = hw_counters;
+        totals.total = total;
+        totals.files_opened = files_opened;
+        totals.probes = probes;
+        totals.reads = reads;
+        totals.read_bytes = read_bytes;
+        totals.dirs = dirs;
+        return totals;
+    }
+
+    /**
+     * Выводит таблицу счётчиков по фазам для каждого файла и итог
+     */
+    void Print(ostream& out) const {
+        if (!hw_counters) {
+            out << "hardware counters unavailable, only time is reported\n";
+        }
+        for (const auto& unit : units) {
+            out << unit.input_file.string() << '\n';
+            PrintPhases(out, unit.phases);
+        }
+        out << "total\n";
+        PrintPhases(out, total);
+        out << "files_opened=" << files_opened << " probes=" << probes << '\n';
+        out << "reads";
+        for (size_t i = 0; i < kReadMethodCount; ++i) {
+            out << ' ' << GetReadMethodName(static_cast<ReadMethod>(i)) << '=' << reads[i] << " (" << read_bytes[i]
+                << " bytes)";
+        }
+        out << '\n';
+        if (!dirs.empty()) {
+            out << "include dirs\n";
+        }
+        for (const auto& usage : dirs) {
+            out << "  " << (usage.dir.empty() ? "(including file's directory)"s : usage.dir.string())
+                << " probes=" << usage.probes << " hits=" << usage.hits << " shadowed=" << usage.shadowed
+                << (usage.hits == 0 ? " unused" : "") << '\n';
+        }
+    }
+
+private:
+    static void PrintPhases(ostream& out, const PhaseTable& phases) {
+        for (size_t i = 0; i < kPhaseCount; ++i) {
+            const PhaseCounters& c = phases[i];
+            out << "  " << GetPhaseName(static_cast<Phase>(i))
+                << " time_us=" << c.nanoseconds / 1000 << " intervals=" << c.intervals;
+            if (HasHardwareValues(c)) {
+                out << " cycles=" << c.cycles << " instructions=" << c.instructions
+                    << " branch_misses=" << c.branch_misses << " llc_misses=" << c.llc_misses;
+            }
+            out << '\n';
+        }
+    }
+
+    static bool HasHardwareValues(const PhaseCounters& c) {
+        return c.cycles || c.instructions || c.branch_misses || c.llc_misses;
+    }
+};
+
+/**
+ * Группа аппаратных счётчиков текущего потока (cycles, instructions,
+ * branch-misses, LLC-misses), открытая через perf_event_open
+ * Считается только пользовательский код (exclude_kernel)
+ * Если ядро или права не позволяют открыть счётчик, он просто не читается;
+ * на системах без perf_event_open группа всегда пуста
+ */
+class HardwareCounters {
+public:
+    static constexpr size_t kCount = 4;
+
+    HardwareCounters() {
+#ifdef __linux__
+        const uint64_t configs[kCount] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                          PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+        for (size_t i = 0; i < kCount; ++i) {
+            const int fd = Open(configs[i]);
+            if (fd < 0) {
+                continue;
+            }
+            if (leader_ < 0) {
+                leader_ = fd;
+            }
+            slots_[i] = static_cast<int>(fds_.size());
+            fds_.push_back(fd);
+        }
+        if (leader_ >= 0) {
+            ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+
+    ~HardwareCounters() {
+#ifdef __linux__
+        for (int fd : fds_) {
+            close(fd);
+        }
+#endif
+    }
+
+    HardwareCounters(const HardwareCounters&) = delete;
+    HardwareCounters& operator=(const HardwareCounters&) = delete;
+
+    bool IsAvailable() const {
+        return leader_ >= 0;
+    }
+
+    /**
+     * Читает текущие значения всей группы одним системным вызовом
+     * Порядок: cycles, instructions, branch-misses, LLC-misses
+     */
+    void Read(uint64_t (&values)[kCount]) const {
+        fill(begin(values), end(values), 0);
+#ifdef __linux__
+        if (leader_ < 0) {
+            return;
+        }
+        uint64_t buffer[1 + kCount] = {};
+        if (read(leader_, buffer, sizeof(buffer)) <= 0) {
+            return;
+        }
+        for (size_t i = 0; i < kCount; ++i) {
+            if (slots_[i] >= 0 && static_cast<uint64_t>(slots_[i]) < buffer[0]) {
+                values[i] = buffer[1 + slots_[i]];
+            }
+        }
+#endif
+    }
+
+private:
+#ifdef __linux__
+    int Open(uint64_t config) const {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = leader_ < 0 ? 1 : 0;
+        // Считаем только пользовательский код: иначе в фазу попадали бы
+        // системные вызовы самого профилировщика при чтении группы
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0));
+    }
+#endif
+
+    int leader_ = -1;
+    int slots_[kCount] = {-1, -1, -1, -1}; // позиция счётчика в группе или -1
+    vector<int> fds_;
+};
+
+/**
+ * Учёт счётчиков по фазам обработки одного входного файла
+ * Время и значения счётчиков между двумя переключениями фазы
+ * относятся к фазе, которая была активна
+ */
+class PhaseProfiler {
+public:
+    explicit PhaseProfiler(PhaseTable& phases)
+        : phases_(phases), last_time_(chrono::steady_clock::now()) {
+        counters_.Read(last_values_);
+    }
+
+    bool HasHardwareCounters() const {
+        return counters_.IsAvailable();
+    }
+
+    /**
+     * Переключает активную фазу
+     */
+    void Enter(Phase phase) {
+        if (phase != current_) {
+            Flush();
+            current_ = phase;
+        }
+    }
+
+    Phase Current() const {
+        return current_;
+    }
+
+    /**
+     * Учитывает время и счётчики, накопленные с последнего переключения
+     */
+    void Flush() {
+        auto now = chrono::steady_clock::now();
+        uint64_t values[HardwareCounters::kCount];
+        counters_.Read(values);
+
+        PhaseCounters& c = phases_[static_cast<size_t>(current_)];
+        ++c.intervals;
+        c.nanoseconds += chrono::duration_cast<chrono::nanoseconds>(now - last_time_).count();
+        c.cycles += values[0] - last_values_[0];
+        c.instructions += values[1] - last_values_[1];
+        c.branch_misses += values[2] - last_values_[2];
+        c.llc_misses += values[3] - last_values_[3];
+
+        last_time_ = now;
+        copy(begin(values), end(values), begin(last_values_));
+    }
+
+    /**
+     * Начинает отсчёт заново, не учитывая время с последнего переключения
+     * Нужно, когда поток отвлекался на постороннюю работу
+     */
+    void Restart() {
+        last_time_ = chrono::steady_clock::now();
+        counters_.Read(last_values_);
+    }
+
+private:
+    PhaseTable& phases_;
+    HardwareCounters counters_;
+    Phase current_ = Phase::kRead;
+    chrono::steady_clock::time_point last_time_;
+    uint64_t last_values_[HardwareCounters::kCount] = {};
+};
+
+/**
+ * Пул потоков для одновременной проверки наличия файла в нескольких директориях
+ * На сетевых файловых системах каждая проверка - это обращение к серверу;
+ * при одновременной отправке поиск по N директориям занимает примерно одно
+ * обращение вместо N. Результат совпадает с последовательным поиском
+ */
+class ProbePool {
+public:
+    /**
+     * @param threads - число потоков; без потоков кандидаты проверяются
+     *                  по очереди в вызывающем потоке
+     */
+    explicit ProbePool(size_t threads) {
+        for (size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back([this]() {
+                Work();
+            });
+        }
+    }
+
+    ~ProbePool() {
+        {
+            lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    ProbePool(const ProbePool&) = delete;
+    ProbePool& operator=(const ProbePool&) = delete;
+
+    /**
+     * Ищет первый существующий файл среди кандидатов
+     * Первый кандидат проверяется в вызывающем потоке, остальные - в пуле.
+     * Ожидание заканчивается, как только определён первый по порядку
+     * существующий кандидат; ещё не начатые проверки после этого отменяются
+     *
+     * @param candidates - пути в порядке поиска
+     * @return номер первого существующего кандидата или candidates.size()
+     */
+    size_t FindFirst(const vector<path>& candidates) {
+        if (candidates.empty()) {
+            return 0;
+        }
+        if (threads_.empty()) {
+            size_t i = 0;
+            while (i < candidates.size() && !filesystem::exists(candidates[i])) {
+                ++i;
+            }
+            return i;
+        }
+        auto lookup = make_shared<Lookup>();
+        lookup->states.assign(candidates.size(), kUnknown);
+        {
+            lock_guard lock(mutex_);
+            for (size_t i = 1; i < candidates.size(); ++i) {
+                tasks_.push_back({lookup, candidates[i], i});
+            }
+        }
+        cv_.notify_all();
+
+        bool first_exists = filesystem::exists(candidates[0]);
+        unique_lock lock(lookup->state_mutex);
+        lookup->states[0] = first_exists ? kPresent : kAbsent;
+        size_t result = candidates.size();
+        lookup->state_cv.wait(lock, [&]() {
+            for (size_t i = 0; i < lookup->states.size(); ++i) {
+                if (lookup->states[i] == kUnknown) {
+                    return false;
+                }
+                if (lookup->states[i] == kPresent) {
+                    result = i;
+                    return true;
+                }
+            }
+            return true;
+        });
+        lookup->done = true;
+        return result;
+    }
+
+private:
+    enum State : char { kUnknown, kAbsent, kPresent };
+
+    // Состояние одного поиска, разделяемое с задачами пула
+    struct Lookup {
+        mutex state_mutex;
+        condition_variable state_cv;
+        vector<State> states;
+        bool done = false;
+    };
+
+    struct Task {
+        shared_ptr<Lookup> lookup;
+        path candidate;
+        size_t index;
+    };
+
+    void Work() {
+        while (true) {
+            Task task;
+            {
+                unique_lock lock(mutex_);
+                cv_.wait(lock, [this]() {
+                    return stop_ || !tasks_.empty();
+                });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = move(tasks_.front());
+                tasks_.pop_front();
+            }
+            {
+                lock_guard lock(task.lookup->state_mutex);
+                if (task.lookup->done) {
+                    continue;
+                }
+            }
+            bool exists = filesystem::exists(task.candidate);
+            {
+                lock_guard lock(task.lookup->state_mutex);
+                task.lookup->states[task.index] = exists ? kPresent : kAbsent;
+            }
+            task.lookup->state_cv.notify_one();
+        }
+    }
+
+    mutex mutex_;
+    condition_variable cv_;
+    deque<Task> tasks_;
+    bool stop_ = false;
+    vector<thread> threads_;
+};
+
+/**
+ * Индекс смещений строк результата
+ * Запоминает смещение начала каждой interval-й строки, пока результат
+ * записывается, и сохраняется рядом с ним (см. GetLineIndexPath). По индексу
+ * к строке N переходят сразу к ближайшей запомненной строке и пропускают не
+ * больше interval - 1 строк, не просматривая результат с начала
+ */
+class LineIndex {
+public:
+    // Положение строки: смещение запомненной строки и сколько строк пропустить после неё
+    struct Position {
+        uint64_t offset;
+        uint64_t skip_lines;
+    };
+
+    explicit LineIndex(uint32_t interval) : interval_(max<uint32_t>(interval, 1)) {
+    }
+
+    /**
+     * Учитывает очередную порцию записанных данных
+     */
+    void Add(string_view data) {
+        const char* begin = data.data();
+        const char* end = begin + data.size();
+        for (const char* p = begin; (p = static_cast<const char*>(memchr(p, '\n', end - p))) != nullptr;) {
+            ++p;
+            if (++lines_ % interval_ == 0) {
+                offsets_.push_back(bytes_ + static_cast<uint64_t>(p - begin));
+            }
+            last_line_end_ = bytes_ + static_cast<uint64_t>(p - begin);
+        }
+        bytes_ += data.size();
+    }
+
+    /**
+     * Число строк, включая последнюю строку без перевода строки
+     */
+    uint64_t GetLineCount() const {
+        return lines_ + (bytes_ > last_line_end_ ? 1 : 0);
+    }
+
+    uint32_t GetInterval() const {
+        return interval_;
+    }
+
+    /**
+     * Находит строку результата
+     *
+     * @param line - номер строки, начиная с 0
+     * @return положение строки или nullopt, если строк меньше
+     */
+    optional<Position> Find(uint64_t line) const {
+        if (line >= GetLineCount()) {
+            return nullopt;
+        }
+        return Position{offsets_[line / interval_], line % interval_};
+    }
+
+    static optional<LineIndex> LoadFrom(const path& file) {
+        MappedFile mapped(file);
+        if (!mapped.IsOpen()) {
+            return nullopt;
+        }
+        BinaryReader reader{mapped.Data()};
+        if (reader.String() != kMagic) {
+            return nullopt;
+        }
+        LineIndex index(reader.U32());
+        index.bytes_ = static_cast<uint64_t>(reader.I64());
+        index.lines_ = static_cast<uint64_t>(reader.I64());
+        index.last_line_end_ = static_cast<uint64_t>(reader.I64());
+        uint64_t count = index.lines_ / index.interval_ + 1;
+        if (!reader.ok || count > (reader.data.size() - reader.pos) / sizeof(uint64_t)) {
+            return nullopt;
+        }
+        index.offsets_.resize(count);
+        reader.Read(index.offsets_.data(), count * sizeof(uint64_t));
+        if (!reader.ok) {
+            return nullopt;
+        }
+        return index;
+    }
+
+    bool SaveTo(const path& file) const {
+        ofstream out(file, ios::binary);
+        WriteString(out, string(kMagic));
+        WriteU32(out, interval_);
+        WriteI64(out, static_cast<int64_t>(bytes_));
+        WriteI64(out, static_cast<int64_t>(lines_));
+        WriteI64(out, static_cast<int64_t>(last_line_end_));
+        out.write(reinterpret_cast<const char*>(offsets_.data()),
+                  static_cast<streamsize>(offsets_.size() * sizeof(uint64_t)));
+        return static_cast<bool>(out);
+    }
+
+private:
+    static constexpr string_view kMagic = "PPLINES1"sv;
+
+    uint32_t interval_;
+    uint64_t bytes_ = 0;         // всего записано байт
+    uint64_t lines_ = 0;         // завершённых строк
+    uint64_t last_line_end_ = 0; // смещение после последнего '\n'
+    vector<uint64_t> offsets_ = {0};
+};
+
+/**
+ * Путь к индексу строк результата: рядом с ним, с добавленным ".lines"
+ */
+path GetLineIndexPath(const path& output_file) {
+    path index_file = output_file;
+    index_file += ".lines";
+    return index_file;
+}
+
+/**
+ * Читает строку результата по его индексу строк
+ *
+ * @param output_file - файл результата
+ * @param index - индекс, построенный при записи этого файла
+ * @param line - номер строки, начиная с 0
+ * @return строка без перевода строки или nullopt, если её нет
+ */
+optional<string> ReadOutputLine(const path& output_file, const LineIndex& index, uint64_t line) {
+    optional<LineIndex::Position> position = index.Find(line);
+    if (!position) {
+        return nullopt;
+    }
+    ifstream input(output_file, ios::binary);
+    input.seekg(static_cast<streamoff>(position->offset));
+    string result;
+    for (uint64_t i = 0; i <= position->skip_lines; ++i) {
+        if (!getline(input, result)) {
+            return nullopt;
+        }
+    }
+    return result;
+}
+
+/**
+ * Разбиение результата на части
+ * Часть заканчивается на первом переводе строки после того, как её размер
+ * достиг заданного, поэтому строки не разрываются между частями. Для каждой
+ * части запоминаются размер, число строк и файлы, текст которых в неё попал.
+ * Описание частей по порядку сохраняется в манифест (см. SaveManifest)
+ */
+class OutputChunks {
+public:
+    struct Chunk {
+        path file;
+        uint64_t bytes = 0;
+        uint64_t lines = 0;
+        vector<path> sources; // в порядке первого появления
+    };
+
+    OutputChunks(const path& output_file, uint64_t target_size)
+        : output_file_(output_file), target_size_(max<uint64_t>(target_size, 1)) {
+    }
+
+    /**
+     * Начинает следующую часть
+     *
+     * @return путь к её файлу
+     */
+    const path& StartChunk() {
+        Chunk& chunk = chunks_.emplace_back();
+        chunk.file = GetChunkPath(output_file_, chunks_.size() - 1);
+        at_line_start_ = true;
+        source_recorded_ = false;
+        return chunk.file;
+    }
+
+    /**
+     * Сколько байт можно добавить в текущую часть до заданного размера
+     */
+    uint64_t GetRoom() const {
+        uint64_t bytes = chunks_.back().bytes;
+        return bytes < target_size_ ? target_size_ - bytes : 0;
+    }
+
+    // Закончилась ли добавленная часть строкой целиком
+    bool IsAtLineStart() const {
+        return at_line_start_;
+    }
+
+    /**
+     * Файл, текст которого добавляется сейчас. Путь должен жить до
+     * следующего вызова SetSource
+     */
+    void SetSource(const path& file) {
+        source_ = &file;
+        source_recorded_ = false;
+    }
+
+    void Add(string_view data) {
+        if (data.empty()) {
+            return;
+        }
+        Chunk& chunk = chunks_.back();
+        chunk.bytes += data.size();
+        chunk.lines += static_cast<uint64_t>(count(data.begin(), data.end(), '\n'));
+        at_line_start_ = data.back() == '\n';
+        if (source_ && !source_recorded_) {
+            if (find(chunk.sources.begin(), chunk.sources.end(), *source_) == chunk.sources.end()) {
+                chunk.sources.push_back(*source_);
+            }
+            source_recorded_ = true;
+        }
+    }
+
+    const vector<Chunk>& GetChunks() const {
+        return chunks_;
+    }
+
+    /**
+     * Сохраняет манифест: число частей, затем для каждой части строка
+     * "chunk <имя файла> <байт> <строк>" и строки "source <путь>".
+     * Части, оставшиеся от прошлого запуска с большим числом частей, удаляются
+     */
+    bool SaveManifest() const {
+        {
+            ofstream out(GetManifestPath(output_file_));
+            out << "chunks " << chunks_.size() << '\n';
+            for (const auto& chunk : chunks_) {
+                out << "chunk " << chunk.file.filename().string() << ' ' << chunk.bytes << ' ' << chunk.lines << '\n';
+                for (const auto& source : chunk.sources) {
+                    out << "source " << source.string() << '\n';
+                }
+            }
+            if (!out) {
+                return false;
+            }
+        }
+        RemoveStaleChunks(output_file_, chunks_.size());
+        return true;
+    }
+
+    /**
+     * Копирует результат, записанный частями, под другим именем: файлы
+     * частей и манифест с их новыми именами
+     *
+     * @param copy - копирование одного файла
+     */
+    static bool CopyChunks(const path& from, const path& to, const function<bool(const path&, const path&)>& copy) {
+        ifstream manifest(GetManifestPath(from));
+        if (!manifest) {
+            return false;
+        }
+        ostringstream copied;
+        size_t count = 0;
+        for (string line; getline(manifest, line);) {
+            if (line.rfind("chunk ", 0) == 0) {
+                size_t name_end = line.find(' ', 6);
+                if (name_end == string::npos || !copy(GetChunkPath(from, count), GetChunkPath(to, count))) {
+                    return false;
+                }
+                line = "chunk " + GetChunkPath(to, count).filename().string() + line.substr(name_end);
+                ++count;
+            }
+            copied << line << '\n';
+        }
+        {
+            ofstream out(GetManifestPath(to));
+            out << copied.str();
+            if (!out) {
+                return false;
+            }
+        }
+        RemoveStaleChunks(to, count);
+        return true;
+    }
+
+    static path GetChunkPath(const path& output_file, size_t index) {
+        path chunk_file = output_file;
+        chunk_file += "." + to_string(index);
+        return chunk_file;
+    }
+
+    static path GetManifestPath(const path& output_file) {
+        path manifest_file = output_file;
+        manifest_file += ".manifest";
+        return manifest_file;
+    }
+
+private:
+    // Удаляет части с номерами от count, не описанные манифестом
+    static void RemoveStaleChunks(const path& output_file, size_t count) {
+        for (size_t i = count;; ++i) {
+            error_code err;
+            if (!filesystem::remove(GetChunkPath(output_file, i), err)) {
+                break;
+            }
+        }
+    }
+
+    path output_file_;
+    uint64_t target_size_;
+    vector<Chunk> chunks_;
+    bool at_line_start_ = true;
+    const path* source_ = nullptr;
+    bool source_recorded_ = false; // текущий файл уже записан в источники текущей части
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+/**
+ * Inode результатов, хранимых в OutputStore, известных процессу: созданных
+ * им или найденных при открытии хранилища. Выходной файл с таким inode -
+ * жёсткая ссылка на хранимый результат, и запись в него на месте изменила
+ * бы хранилище и все одинаковые результаты
+ */
+class StoredBlobs {
+public:
+    static void Add(const struct stat& st) {
+        Registry& registry = GetRegistry();
+        lock_guard lock(registry.inodes_mutex);
+        registry.inodes.emplace(st.st_dev, st.st_ino);
+    }
+
+    static bool Contains(const struct stat& st) {
+        Registry& registry = GetRegistry();
+        lock_guard lock(registry.inodes_mutex);
+        return registry.inodes.count({st.st_dev, st.st_ino}) != 0;
+    }
+
+private:
+    struct Registry {
+        mutex inodes_mutex;
+        set<pair<dev_t, ino_t>> inodes;
+    };
+
+    static Registry& GetRegistry() {
+        static Registry registry;
+        return registry;
+    }
+};
+#endif
+
+/**
+ * Приёмник результата препроцессинга
+ * Буферизует запись в выходной файл. Если выходной файл - канал (pipe),
+ * заполненные буферы передаются в него через vmsplice без копирования,
+ * а файлы, копируемые без изменений, - через splice из их дескриптора.
+ * Для остальных файлов используется обычный write()
+ *
+ * Буфер, переданный через vmsplice, повторно используется только после того,
+ * как читатель канала прочитал его данные (по FIONREAD), поэтому читатель
+ * должен забирать данные read(), а не splice. Буферы отображаются через
+ * mmap: канал держит ссылки на страницы переданного буфера, и после munmap
+ * они не достаются никому другому, поэтому приёмник можно уничтожить, не
+ * дожидаясь читателя
+ *
+ * Если задан индекс строк, все данные проходят через Write и учитываются
+ * в нём; передача файлов через SpliceFile при этом отключается. Так же
+ * работает разбиение на части: заполнив часть до конца строки, приёмник
+ * переходит к файлу следующей части
+ */
+class OutputSink {
+public:
+    explicit OutputSink(const path& file) {
+#if defined(__unix__) || defined(__APPLE__)
+        fd_ = OpenForWrite(file);
+        if (fd_ < 0) {
+            return;
+        }
+        owns_fd_ = true;
+        Attach();
+#else
+        stream_.open(file, ios::binary);
+        if (!stream_.is_open()) {
+            return;
+        }
+        is_open_ = true;
+        buffer_ = AcquireBuffer();
+#endif
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    /**
+     * Приёмник, пишущий в уже открытый дескриптор
+     * Дескриптор остаётся открытым после уничтожения приёмника
+     */
+    explicit OutputSink(int fd) : fd_(fd) {
+        if (fd_ >= 0) {
+            Attach();
+        }
+    }
+#endif
+
+    ~OutputSink() {
+        Flush();
+#if defined(__unix__) || defined(__APPLE__)
+        if (owns_fd_) {
+            close(fd_);
+        }
+#endif
+    }
+
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+
+    bool IsOpen() const {
+        return is_open_;
+    }
+
+    /**
+     * Можно ли передавать файлы в выход через SpliceFile
+     */
+    bool CanSpliceFiles() const {
+        return is_pipe_ && !line_index_ && !chunks_;
+    }
+
+    void SetLineIndex(LineIndex* line_index) {
+        line_index_ = line_index;
+    }
+
+    /**
+     * Включает учёт записи заполненных буферов в фазе kWrite; nullptr - выключает
+     */
+    void SetProfiler(PhaseProfiler* profiler) {
+        profiler_ = profiler;
+    }
+
+    /**
+     * Включает разбиение на части; приёмник должен быть открыт на файл
+     * первой части, начатой chunks->StartChunk()
+     */
+    void SetChunks(OutputChunks* chunks) {
+        chunks_ = chunks;
+    }
+
+    /**
+     * Сообщает, текст какого файла записывается (для манифеста частей)
+     */
+    void SetSource(const path& file) {
+        if (chunks_) {
+            chunks_->SetSource(file);
+        }
+    }
+
+    void Write(string_view data) {
+        if (line_index_) {
+            line_index_->Add(data);
+        }
+        if (chunks_) {
+            WriteChunked(data);
+            return;
+        }
+        WriteBuffered(data);
+    }
+
+    void WriteLine(string_view line) {
+        Write(line);
+        Write("\n"sv);
+    }
+
+    /**
+     * Передаёт в выход size байт файла, начиная с начала, без копирования
+     * в память процесса. Если splice не сработал, оставшаяся часть
+     * дочитывается и записывается обычным образом
+     *
+     * @param fd - дескриптор файла, открытого на чтение
+     * @param size - число байт
+     */
+    void SpliceFile(int fd, size_t size) {
+        Flush();
+#ifdef __linux__
+        loff_t offset = 0;
+        while (is_pipe_ && static_cast<size_t>(offset) < size) {
+            ssize_t n = splice(fd, &offset, fd_, nullptr, size - offset, SPLICE_F_MOVE);
+            if (n <= 0) {
+                break;
+            }
+            written_ += static_cast<uint64_t>(n);
+        }
+        char chunk[kCopyChunk];
+        while (static_cast<size_t>(offset) < size) {
+            ssize_t n = pread(fd, chunk, min(sizeof(chunk), size - offset), offset);
+            if (n <= 0) {
+                failed_ = true;
+                return;
+            }
+            WriteAll(chunk, static_cast<size_t>(n));
+            offset += n;
+        }
+#else
+        (void)fd;
+        (void)size;
+        failed_ = true;
+#endif
+    }
+
+    /**
+     * Отправляет накопленные данные в выходной файл
+     *
+     * @return true, если все записи до сих пор прошли успешно
+     */
+    bool Flush() {
+        if (!is_open_ || used_ == 0) {
+            return is_open_ && !failed_;
+        }
+#ifdef __linux__
+        if (is_pipe_ && TryVmsplice()) {
+            return !failed_;
+        }
+#endif
+        WriteAll(buffer_.get(), used_);
+        used_ = 0;
+        return !failed_;
+    }
+
+private:
+    static constexpr size_t kBufferSize = 64 * 1024;
+    static constexpr size_t kCopyChunk = 16 * 1024;
+    // Сколько буферов может ждать прочтения из канала, прежде чем
+    // приёмник перейдёт на обычную запись
+    static constexpr size_t kMaxInFlight = 64;
+
+#ifdef __linux__
+    struct BufferDeleter {
+        void operator()(char* data) const {
+            munmap(data, kBufferSize);
+        }
+    };
+#else
+    using BufferDeleter = default_delete<char[]>;
+#endif
+    using Buffer = unique_ptr<char[], BufferDeleter>;
+
+    void WriteBuffered(string_view data) {
+        while (!data.empty()) {
+            size_t size = min(data.size(), kBufferSize - used_);
+            memcpy(buffer_.get() + used_, data.data(), size);
+            used_ += size;
+            data.remove_prefix(size);
+            if (used_ == kBufferSize) {
+                InWritePhase([this]() {
+                    Flush();
+                });
+            }
+        }
+    }
+
+    // Запись с переходом к следующей части после заполненной до конца строки
+    void WriteChunked(string_view data) {
+        while (!data.empty()) {
+            size_t size = static_cast<size_t>(min<uint64_t>(data.size(), chunks_->GetRoom()));
+            if (size == 0) {
+                if (chunks_->IsAtLineStart()) {
+                    InWritePhase([this]() {
+                        OpenNextChunk();
+                    });
+                    continue;
+                }
+                // Часть заполнена: она дописывается до конца текущей строки
+                size_t line_end = data.find('\n');
+                size = line_end == string_view::npos ? data.size() : line_end + 1;
+            }
+            chunks_->Add(data.substr(0, size));
+            WriteBuffered(data.substr(0, size));
+            data.remove_prefix(size);
+        }
+    }
+
+    // Выполняет запись в файл в фазе kWrite и возвращает прежнюю фазу: строки
+    // без директив копируются в буфер при просмотре (kScan), но запись
+    // заполненного буфера - уже вывод. Фаза переключается раз на буфер
+    template <typename Func>
+    void InWritePhase(Func func) {
+        if (!profiler_) {
+            func();
+            return;
+        }
+        const Phase phase = profiler_->Current();
+        profiler_->Enter(Phase::kWrite);
+        func();
+        profiler_->Enter(phase);
+    }
+
+    void OpenNextChunk() {
+        Flush();
+        const path& file = chunks_->StartChunk();
+#if defined(__unix__) || defined(__APPLE__)
+        if (owns_fd_) {
+            close(fd_);
+        }
+        fd_ = OpenForWrite(file);
+        owns_fd_ = fd_ >= 0;
+        is_pipe_ = false;
+        failed_ = failed_ || fd_ < 0;
+#else
+        stream_.close();
+        stream_.open(file, ios::binary);
+        failed_ = failed_ || !stream_.is_open();
+#endif
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    /**
+     * Открывает файл для записи с начала
+     * Ссылка на результат из OutputStore (StoredBlobs) сначала удаляется:
+     * запись на месте изменила бы хранимый результат. Остальные файлы с
+     * несколькими жёсткими ссылками пишутся на месте, как обычно
+     */
+    static int OpenForWrite(const path& file) {
+        struct stat st;
+        if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1 && StoredBlobs::Contains(st)) {
+            unlink(file.c_str());
+        }
+        return open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+
+    void Attach() {
+#ifdef __linux__
+        struct stat st;
+        is_pipe_ = fstat(fd_, &st) == 0 && S_ISFIFO(st.st_mode);
+#endif
+        is_open_ = true;
+        buffer_ = AcquireBuffer();
+    }
+#endif
+
+    Buffer AcquireBuffer() {
+        if (!free_buffers_.empty()) {
+            auto buffer = move(free_buffers_.back());
+            free_buffers_.pop_back();
+            return buffer;
+        }
+#ifdef __linux__
+        void* data = mmap(nullptr, kBufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            throw bad_alloc();
+        }
+        return Buffer(static_cast<char*>(data));
+#else
+        return Buffer(new char[kBufferSize]);
+#endif
+    }
+
+    void WriteAll(const char* data, size_t size) {
+#if defined(__unix__) || defined(__APPLE__)
+        while (size > 0) {
+            ssize_t n = write(fd_, data, size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                failed_ = true;
+                return;
+            }
+            written_ += static_cast<uint64_t>(n);
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+#else
+        stream_.write(data, static_cast<streamsize>(size));
+        failed_ = failed_ || !stream_;
+#endif
+    }
+
+#ifdef __linux__
+    /**
+     * Передаёт текущий буфер в канал через vmsplice и берёт новый
+     * Возвращает false, если буфер нужно записать обычным образом
+     */
+    bool TryVmsplice() {
+        RecycleBuffers();
+        if (in_flight_.size() >= kMaxInFlight) {
+            // Читатель не сообщает о прочитанном - копировать безопаснее
+            is_pipe_ = false;
+            return false;
+        }
+        size_t sent = 0;
+        while (sent < used_) {
+            iovec iov{buffer_.get() + sent, used_ - sent};
+            ssize_t n = vmsplice(fd_, &iov, 1, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            sent += static_cast<size_t>(n);
+        }
+        written_ += sent;
+        const uint64_t sent_end = written_;
+        if (sent < used_) {
+            WriteAll(buffer_.get() + sent, used_ - sent);
+            is_pipe_ = false;
+        }
+        if (sent > 0) {
+            in_flight_.push_back({move(buffer_), sent_end});
+            buffer_ = AcquireBuffer();
+        }
+        used_ = 0;
+        return true;
+    }
+
+    // Возвращает в пул буферы, данные которых читатель канала уже забрал
+    void RecycleBuffers() {
+        int unread = 0;
+        if (in_flight_.empty() || ioctl(fd_, FIONREAD, &unread) != 0 || unread < 0) {
+            return;
+        }
+        uint64_t consumed = written_ - min(written_, static_cast<uint64_t>(unread));
+        while (!in_flight_.empty() && in_flight_.front().end <= consumed) {
+            free_buffers_.push_back(move(in_flight_.front().data));
+            in_flight_.pop_front();
+        }
+    }
+#endif
+
+    // Буфер, переданный в канал и ещё не прочитанный из него полностью
+    struct InFlightBuffer {
+        Buffer data;
+        uint64_t end; // значение written_ после передачи этого буфера
+    };
+
+
+    int fd_ = -1;
+    bool owns_fd_ = false;
+#if !defined(__unix__) && !defined(__APPLE__)
+    ofstream stream_;
+#endif
+    bool is_open_ = false;
+    bool is_pipe_ = false;
+    bool failed_ = false;
+    LineIndex* line_index_ = nullptr;
+    OutputChunks* chunks_ = nullptr;
+    PhaseProfiler* profiler_ = nullptr;
+    Buffer buffer_;
+    size_t used_ = 0;
+    uint64_t written_ = 0; // всего байт передано в выходной файл любым способом
+    deque<InFlightBuffer> in_flight_;
+    vector<Buffer> free_buffers_;
+};
+
+// Метка порядка байтов UTF-8 в начале файла
+constexpr string_view kUtf8Bom = "\xEF\xBB\xBF"sv;
+
+/**
+ * Ищет байт в тексте, начиная с позиции pos
+ * С SSE2 проверяет по 16 байт за сравнение, иначе побайтно
+ *
+ * @return позиция байта или string_view::npos
+ */
+size_t FindByte(string_view text, size_t pos, char byte) {
+#if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i needle = _mm_set1_epi8(byte);
+    for (; pos + 16 <= text.size(); pos += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + pos));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return pos + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+        }
+    }
+#endif
+    for (; pos < text.size(); ++pos) {
+        if (text[pos] == byte) {
+            return pos;
+        }
+    }
+    return string_view::npos;
+}
+
+/**
+ * Записывает текст, заменяя переводы строк CRLF на LF
+ * Одиночный '\r' не в паре с '\n' сохраняется. Участки без '\r'
+ * записываются целиком, поэтому для текста с LF это почти простое копирование
+ */
+void WriteNormalized(OutputSink& output, string_view text) {
+    size_t start = 0;
+    for (size_t cr = FindByte(text, 0, '\r'); cr != string_view::npos; cr = FindByte(text, cr + 1, '\r')) {
+        if (cr + 1 < text.size() && text[cr + 1] == '\n') {
+            output.Write(text.substr(start, cr - start));
+            start = cr + 1;
+        }
+    }
+    output.Write(text.substr(start));
+}
+
+/**
+ * Кодировка исходного файла, определяемая по BOM
+ */
+enum class TextEncoding {
+    kUtf8,    // UTF-8 или ASCII, с BOM или без
+    kUtf16Le, // BOM FF FE
+    kUtf16Be, // BOM FE FF
+};
+
+TextEncoding DetectEncoding(string_view data) {
+    if (data.size() >= 2 && data[0] == '\xFF' && data[1] == '\xFE') {
+        return TextEncoding::kUtf16Le;
+    }
+    if (data.size() >= 2 && data[0] == '\xFE' && data[1] == '\xFF') {
+        return TextEncoding::kUtf16Be;
+    }
+    return TextEncoding::kUtf8;
+}
+
+#ifdef __SSE2__
+/**
+ * Записывает 16-битные значения из регистра по их смещениям
+ * Значение в 2 байта пишется всегда; следующее значение со смещением на
+ * 1 байт перезаписывает лишний второй байт символа ASCII
+ */
+template <size_t... kLanes>
+void StoreEncodedPairs(char* out, __m128i values, __m128i offsets, index_sequence<kLanes...>) {
+    auto store = [&](auto lane) {
+        uint16_t value = static_cast<uint16_t>(_mm_extract_epi16(values, decltype(lane)::value));
+        memcpy(out + _mm_extract_epi16(offsets, decltype(lane)::value), &value, 2);
+    };
+    (store(integral_constant<int, kLanes>()), ...);
+}
+#endif
+
+/**
+ * Перекодирует символы UTF-16 с заданным порядком байтов в UTF-8
+ * Участки ASCII упаковываются в байты по 16 символов командами SSE2. Блок
+ * из 8 символов не старше U+07FF (кириллица, латиница с диакритикой)
+ * кодируется в регистре и записывается без ветвлений; остальное - по
+ * одному символу. Непарные суррогаты заменяются символом U+FFFD
+ *
+ * @param in - символы UTF-16
+ * @param units - число символов
+ * @param out - буфер не меньше units * 3 байт
+ * @return число записанных байтов
+ */
+template <bool kBigEndian>
+size_t TranscodeUtf16Units(const unsigned char* in, size_t units, char* out) {
+    char* const out_begin = out;
+    auto unit_at = [in](size_t index) -> uint32_t {
+        const unsigned char* p = in + index * 2;
+        return kBigEndian ? (uint32_t{p[0]} << 8) | p[1] : (uint32_t{p[1]} << 8) | p[0];
+    };
+    auto put = [&out](uint32_t code) {
+        if (code < 0x80) {
+            *out++ = static_cast<char>(code);
+        } else if (code < 0x800) {
+            *out++ = static_cast<char>(0xC0 | (code >> 6));
+            *out++ = static_cast<char>(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+            *out++ = static_cast<char>(0xE0 | (code >> 12));
+            *out++ = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            *out++ = static_cast<char>(0x80 | (code & 0x3F));
+        } else {
+            *out++ = static_cast<char>(0xF0 | (code >> 18));
+            *out++ = static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            *out++ = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            *out++ = static_cast<char>(0x80 | (code & 0x3F));
+        }
+    };
+    auto put_general = [&](size_t& i) {
+        uint32_t code = unit_at(i);
+        if (code >= 0xD800 && code < 0xDC00 && i + 1 < units) {
+            uint32_t next = unit_at(i + 1);
+            if (next >= 0xDC00 && next < 0xE000) {
+                put(0x10000 + ((code - 0xD800) << 10) + (next - 0xDC00));
+                ++i;
+                return;
+            }
+        }
+        put(code >= 0xD800 && code < 0xE000 ? 0xFFFD : code);
+    };
+
+    size_t i = 0;
+    while (i + 8 <= units) {
+        uint32_t high_bits = 0;
+#ifdef __SSE2__
+        // Участки ASCII упаковываются по 16 символов без других проверок
+        const __m128i non_ascii = _mm_set1_epi16(static_cast<short>(0xFF80));
+        for (; i + 16 <= units; i += 16, out += 16) {
+            __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 2));
+            __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 2 + 16));
+            if (kBigEndian) {
+                low = _mm_or_si128(_mm_slli_epi16(low, 8), _mm_srli_epi16(low, 8));
+                high = _mm_or_si128(_mm_slli_epi16(high, 8), _mm_srli_epi16(high, 8));
+            }
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(_mm_or_si128(low, high), non_ascii),
+                                                  _mm_setzero_si128())) != 0xFFFF) {
+                break;
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(low, high));
+        }
+        if (i + 8 > units) {
+            break;
+        }
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i * 2));
+        if (kBigEndian) {
+            block = _mm_or_si128(_mm_slli_epi16(block, 8), _mm_srli_epi16(block, 8));
+        }
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(block, non_ascii), zero);
+        const int ascii_mask = _mm_movemask_epi8(ascii);
+        if (ascii_mask == 0xFFFF) {
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(block, block));
+            out += 8;
+            i += 8;
+            continue;
+        }
+        const __m128i above_two_bytes = _mm_and_si128(block, _mm_set1_epi16(static_cast<short>(0xF800)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(above_two_bytes, zero)) == 0xFFFF) {
+            // Каждый символ даёт 16-битное значение: сам символ ASCII или пару
+            // байтов 110xxxxx 10xxxxxx; затем значения записываются подряд
+            // со сдвигом на 1 или 2 байта
+            const __m128i lead = _mm_or_si128(_mm_srli_epi16(block, 6), _mm_set1_epi16(0xC0));
+            const __m128i trail = _mm_or_si128(_mm_and_si128(block, _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+            const __m128i pair = _mm_or_si128(lead, _mm_slli_epi16(trail, 8));
+            const __m128i encoded = _mm_or_si128(_mm_and_si128(ascii, block), _mm_andnot_si128(ascii, pair));
+            // Смещения значений - префиксные суммы длин, записи не зависят друг от друга
+            const __m128i lengths = _mm_sub_epi16(_mm_set1_epi16(2), _mm_and_si128(ascii, _mm_set1_epi16(1)));
+            __m128i ends = _mm_add_epi16(lengths, _mm_slli_si128(lengths, 2));
+            ends = _mm_add_epi16(ends, _mm_slli_si128(ends, 4));
+            ends = _mm_add_epi16(ends, _mm_slli_si128(ends, 8));
+            const __m128i offsets = _mm_sub_epi16(ends, lengths);
+            if (ascii_mask == 0) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), encoded);
+            } else {
+                StoreEncodedPairs(out, encoded, offsets, make_index_sequence<8>());
+            }
+            out += _mm_extract_epi16(ends, 7);
+            i += 8;
+            continue;
+        }
+        high_bits = 0xF800;
+#else
+        for (size_t j = i; j < i + 8; ++j) {
+            high_bits |= unit_at(j) & 0xF800;
+        }
+#endif
+        if (high_bits == 0) {
+            // Без ветвлений: всегда пишутся два байта, указатель сдвигается на длину
+            for (size_t end = i + 8; i < end; ++i) {
+                uint32_t code = unit_at(i);
+                uint32_t two_bytes = code >= 0x80;
+                out[0] = static_cast<char>(two_bytes ? 0xC0 | (code >> 6) : code);
+                out[1] = static_cast<char>(0x80 | (code & 0x3F));
+                out += 1 + two_bytes;
+            }
+        } else {
+            for (size_t end = i + 8; i < end; ++i) {
+                put_general(i);
+            }
+        }
+    }
+    for (; i < units; ++i) {
+        put_general(i);
+    }
+    return static_cast<size_t>(out - out_begin);
+}
+
+/**
+ * Текст, перекодированный в UTF-8
+ * Буфер выделяется с запасом и без заполнения, а после использования
+ * возвращается в пул потока: следующий перекодируемый файл пишет в уже
+ * отображённые страницы, не тратя время на их первое заполнение
+ */
+class TranscodedText {
+public:
+    TranscodedText() = default;
+
+    explicit TranscodedText(size_t capacity) {
+        auto& pool = GetPool();
+        auto it = find_if(pool.begin(), pool.end(), [capacity](const Buffer& buffer) {
+            return buffer.capacity >= capacity;
+        });
+        if (it != pool.end()) {
+            buffer_ = move(*it);
+            pool.erase(it);
+        } else {
+            buffer_ = {unique_ptr<char[]>(new char[capacity]), capacity};
+        }
+    }
+
+    TranscodedText(TranscodedText&&) = default;
+    TranscodedText& operator=(TranscodedText&& other) {
+        Release();
+        buffer_ = move(other.buffer_);
+        size_ = other.size_;
+        return *this;
+    }
+
+    ~TranscodedText() {
+        Release();
+    }
+
+    char* Data() {
+        return buffer_.data.get();
+    }
+
+    void SetSize(size_t size) {
+        size_ = size;
+    }
+
+    string_view View() const {
+        return {buffer_.data.get(), size_};
+    }
+
+private:
+    // Сколько буферов хранит пул потока; вложенные include держат по буферу
+    static constexpr size_t kPooledBuffers = 4;
+
+    struct Buffer {
+        unique_ptr<char[]> data;
+        size_t capacity = 0;
+    };
+
+    static vector<Buffer>& GetPool() {
+        static thread_local vector<Buffer> pool;
+        return pool;
+    }
+
+    void Release() {
+        if (!buffer_.data) {
+            return;
+        }
+        auto& pool = GetPool();
+        if (pool.size() == kPooledBuffers) {
+            // Вытесняется самый маленький буфер
+            auto smallest = min_element(pool.begin(), pool.end(), [](const Buffer& a, const Buffer& b) {
+                return a.capacity < b.capacity;
+            });
+            if (smallest->capacity >= buffer_.capacity) {
+                buffer_ = {};
+                return;
+            }
+            pool.erase(smallest);
+        }
+        pool.push_back(move(buffer_));
+        buffer_ = {};
+    }
+
+    Buffer buffer_;
+    size_t size_ = 0;
+};
+
+/**
+ * Перекодирует текст UTF-16 в UTF-8
+ * BOM перекодируется в BOM UTF-8, нечётный последний байт заменяется
+ * символом U+FFFD
+ *
+ * @param data - текст UTF-16 вместе с BOM
+ * @param big_endian - порядок байтов
+ * @return текст UTF-8
+ */
+TranscodedText TranscodeUtf16(string_view data, bool big_endian) {
+    const auto* in = reinterpret_cast<const unsigned char*>(data.data());
+    const size_t units = data.size() / 2;
+    TranscodedText result(units * 3 + 3);
+    size_t size = big_endian ? TranscodeUtf16Units<true>(in, units, result.Data())
+                             : TranscodeUtf16Units<false>(in, units, result.Data());
+    if (data.size() % 2 != 0) {
+        memcpy(result.Data() + size, "\xEF\xBF\xBD", 3);
+        size += 3;
+    }
+    result.SetSize(size);
+    return result;
+}
+
+/**
+ * Быстрая проверка, может ли текст содержать директиву #include
+ * Проверка консервативная: ложные срабатывания допустимы, пропуски - нет
+ */
+bool MayContainInclude(string_view text) {
+    for (size_t pos = text.find('#'); pos != string_view::npos; pos = text.find('#', pos + 1)) {
+        size_t i = pos + 1;
+        while (i < text.size() && isspace(static_cast<unsigned char>(text[i]))) {
+            ++i;
+        }
+        if (text.substr(i, 7) == "include"sv) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Фильтр директив, которые не разворачиваются, а выводятся как есть
+ * Директива оставляется, если совпадает её вид (<file.h> или "file.h"),
+ * имя подходит под один из шаблонов или файл найден в одной из отмеченных
+ * директорий include
+ *
+ * В шаблонах * - любые символы, кроме '/', ** - любые символы, ** перед
+ * '/' - ноль или больше директорий, ? - один символ, кроме '/'. Шаблоны
+ * без подстановок и вида prefix/<две звёздочки> проверяются поиском в
+ * хеш-таблице и сравнением начала, остальные - за один проход по имени
+ * для каждого шаблона
+ */
+class IncludeFilter {
+public:
+    bool keep_angle = false; // оставлять все директивы <file.h>
+    bool keep_quote = false; // оставлять все директивы "file.h"
+
+    /**
+     * Строка, однозначно описывающая фильтр: одинаково заданные фильтры
+     * оставляют одни и те же директивы
+     */
+    string GetKey() const {
+        return to_string(keep_angle) + to_string(keep_quote) + '\n' + key_;
+    }
+
+    /**
+     * Оставлять директивы, имя которых подходит под шаблон
+     */
+    void AddGlob(const string& pattern) {
+        key_ += "glob " + pattern + '\n';
+        vector<GlobToken> tokens;
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            if (pattern.compare(i, 3, "**/") == 0) {
+                i += 2;
+                tokens.push_back({GlobToken::kAnyDirs, {}});
+            } else if (pattern[i] == '*') {
+                bool any = i + 1 < pattern.size() && pattern[i + 1] == '*';
+                i += any ? 1 : 0;
+                tokens.push_back({any ? GlobToken::kAnyString : GlobToken::kSegmentString, {}});
+            } else if (pattern[i] == '?') {
+                tokens.push_back({GlobToken::kChar, {}});
+            } else if (!tokens.empty() && tokens.back().kind == GlobToken::kLiteral) {
+                tokens.back().literal += pattern[i];
+            } else {
+                tokens.push_back({GlobToken::kLiteral, string(1, pattern[i])});
+            }
+        }
+
+        if (tokens.empty()) {
+            exact_.insert("");
+        } else if (tokens.size() == 1 && tokens[0].kind == GlobToken::kLiteral) {
+            exact_.insert(tokens[0].literal);
+        } else if (tokens.size() == 2 && tokens[0].kind == GlobToken::kLiteral
+                   && tokens[1].kind == GlobToken::kAnyString) {
+            prefixes_.push_back(tokens[0].literal);
+        } else {
+            globs_.push_back(move(tokens));
+        }
+    }
+
+    /**
+     * Оставлять директивы, файл которых найден в директории dir
+     * (в одной из директорий include, с тем же написанием пути)
+     */
+    void AddDir(const path& dir) {
+        key_ += "dir " + dir.string() + '\n';
+        dirs_.push_back(dir);
+    }
+
+    /**
+     * Нужно ли искать файл, чтобы решить судьбу директивы, не подошедшей
+     * по виду и имени
+     */
+    bool NeedsResolution() const {
+        return !dirs_.empty();
+    }
+
+    /**
+     * Оставляется ли директива по её виду и имени
+     */
+    bool Keeps(const IncludeDirective& directive) const {
+        if (directive.local ? keep_quote : keep_angle) {
+            return true;
+        }
+        if (exact_.count(directive.name) > 0) {
+            return true;
+        }
+        for (const auto& prefix : prefixes_) {
+            if (directive.name.compare(0, prefix.size(), prefix) == 0) {
+                return true;
+            }
+        }
+        for (const auto& glob : globs_) {
+            if (Match(glob, directive.name)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Оставляется ли директива, файл которой найден по пути full_path
+     */
+    bool KeepsResolved(const IncludeDirective& directive, const path& full_path) const {
+        for (const auto& dir : dirs_) {
+            if (full_path == dir / directive.name) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    struct GlobToken {
+        enum Kind { kLiteral, kChar, kSegmentString, kAnyString, kAnyDirs } kind;
+        string literal;
+    };
+
+    // Множество позиций имени, достижимых после очередного элемента шаблона,
+    // продвигается по элементам, поэтому перебора с возвратами нет
+    static bool Match(const vector<GlobToken>& tokens, const string& name) {
+        const size_t n = name.size();
+        vector<char> reach(n + 1, 0);
+        vector<char> next(n + 1, 0);
+        reach[0] = 1;
+        for (const auto& token : tokens) {
+            fill(next.begin(), next.end(), 0);
+            bool any = false;
+            for (size_t pos = 0; pos <= n; ++pos) {
+                if (!reach[pos]) {
+                    continue;
+                }
+                switch (token.kind) {
+                    case GlobToken::kLiteral:
+                        if (name.compare(pos, token.literal.size(), token.literal) == 0) {
+                            next[pos + token.literal.size()] = 1;
+                        }
+                        break;
+                    case GlobToken::kChar:
+                        if (pos < n && name[pos] != '/') {
+                            next[pos + 1] = 1;
+                        }
+                        break;
+                    case GlobToken::kSegmentString:
+                        for (size_t end = pos; !next[end]; ++end) {
+                            next[end] = 1;
+                            if (end == n || name[end] == '/') {
+                                break;
+                            }
+                        }
+                        break;
+                    case GlobToken::kAnyString:
+                        for (size_t end = pos; end <= n && !next[end]; ++end) {
+                            next[end] = 1;
+                        }
+                        break;
+                    case GlobToken::kAnyDirs:
+                        next[pos] = 1;
+                        for (size_t end = pos + 1; end <= n; ++end) {
+                            next[end] = next[end] || name[end - 1] == '/';
+                        }
+                        break;
+                }
+            }
+            reach.swap(next);
+            for (char r : reach) {
+                any = any || r;
+            }
+            if (!any) {
+                return false;
+            }
+        }
+        return reach[n] != 0;
+    }
+
+    unordered_set<string> exact_;
+    vector<string> prefixes_;
+    vector<vector<GlobToken>> globs_;
+    vector<path> dirs_;
+    string key_; // шаблоны и директории в порядке добавления (см. GetKey)
+};
+
+/**
+ * Параметры препроцессинга
+ */
+struct PreprocessOptions {
+    IncludeCache* cache = nullptr;    // кэш тёплого состояния; nullptr - работа без кэша
+    PreprocessStats* stats = nullptr; // статистика по фазам; nullptr - без замеров
+    bool detect_shadowing = false;    // при сборе статистики проверять, есть ли найденный
+                                      // файл и в следующих директориях (лишние проверки)
+    ProbePool* probe_pool = nullptr;  // пул для одновременной проверки директорий include;
+                                      // nullptr - директории проверяются по очереди
+    function<void()> at_include_boundary; // вызывается перед разворачиванием каждого include
+    BloomIndex* bloom_index = nullptr; // фильтры для пропуска директорий include, где файла
+                                       // точно нет; nullptr - проверять все директории
+    IoPolicy io_policy = IoPolicy::GetDefault(); // выбор способа чтения файлов по размеру
+    const IncludeFilter* include_filter = nullptr; // директивы, выводимые как есть; nullptr - все
+                                                   // разворачиваются
+    bool normalize_text = false; // заменять CRLF на LF и убирать BOM UTF-8 в начале каждого файла
+    uint32_t line_index_interval = 0; // если не 0, Preprocess сохраняет индекс строк результата
+                                      // с шагом в столько строк (см. GetLineIndexPath)
+    uint64_t chunk_size = 0; // если не 0, Preprocess пишет результат частями примерно такого
+                             // размера с манифестом вместо одного файла (см. OutputChunks);
+                             // смещения индекса строк тогда отсчитываются от начала первой части
+    bool start_run = true; // начинать новый запуск кэша и фильтров (StartRun) в каждом вызове;
+                           // PreprocessEngine начинает один запуск на пакет заданий
+};
+
+/**
+ * Общее состояние обработки одного входного файла
+ */
+struct PreprocessContext {
+    const vector<path>& include_dirs;
+    const PreprocessOptions& options;
+    size_t dir_set_id = 0;             // номер набора include_dirs в кэше
+    PhaseProfiler* profiler = nullptr; // учёт счётчиков по фазам, если включён
+    vector<size_t> dir_usage = {};     // номера записей PreprocessStats::dirs для include_dirs
+    vector<StampedFile>* read_files = nullptr; // если задан, сюда добавляются все прочитанные файлы
+};
+
+// Переключает фазу учёта счётчиков, если он включён
+void EnterPhase(const PreprocessContext& ctx, Phase phase) {
+    if (ctx.profiler) {
+        ctx.profiler->Enter(phase);
+    }
+}
+
+/**
+ * Ищет файл, указанный в директиве #include
+ * Локальные заголовки ищутся сначала относительно директории текущего файла,
+ * затем в директориях include; системные - только в директориях include
+ *
+ * @param ctx - состояние обработки
+ * @param directive - директива
+ * @param current_file - файл, содержащий директиву
+ * @param full_path - путь к найденному файлу
+ * @return true, если файл найден
+ */
+bool ResolveInclude(const PreprocessContext& ctx, const IncludeDirective& directive,
+                    const path& current_file, path& full_path) {
+    IncludeCache* cache = ctx.options.cache;
+    PreprocessStats* stats = ctx.options.stats;
+    path include_path = directive.name;
+    path current_dir = current_file.parent_path();
+    const size_t dir_count = ctx.include_dirs.size();
+
+    // Учёт использования директорий: hit_index - номер директории include,
+    // в которой найден файл, dir_count - директория текущего файла
+    auto record_hit = [&](size_t hit_index) {
+        if (!stats) {
+            return;
+        }
+        size_t slot = hit_index < dir_count ? ctx.dir_usage[hit_index] : stats->GetDirUsageIndex({});
+        ++stats->dirs[slot].hits;
+        if (!ctx.options.detect_shadowing) {
+            return;
+        }
+        for (size_t i = hit_index < dir_count ? hit_index + 1 : 0; i < dir_count; ++i) {
+            if (filesystem::exists(ctx.include_dirs[i] / include_path)) {
+                ++stats->dirs[ctx.dir_usage[i]].shadowed;
+            }
+        }
+    };
+
+    string key;
+    if (cache) {
+        key = IncludeCache::GetResolutionKey(ctx.dir_set_id, directive.local, current_dir, directive.name);
+        if (auto resolved = cache->FindResolved(key)) {
+            full_path = *resolved;
+            if (stats) {
+                size_t hit_index = 0;
+                while (hit_index < dir_count && ctx.include_dirs[hit_index] / include_path != full_path) {
+                    ++hit_index;
+                }
+                record_hit(hit_index);
+            }
+            return true;
+        }
+    }
+
+    // Кандидаты в порядке поиска: директория текущего файла (для "file.h"),
+    // затем директории include. Для кандидата i возвращается номер директории
+    // include или dir_count для директории текущего файла
+    const size_t first_dir = directive.local ? 1 : 0;
+    const size_t candidate_count = dir_count + first_dir;
+    auto candidate_dir = [&](size_t i) {
+        return i < first_dir ? dir_count : i - first_dir;
+    };
+    auto candidate = [&](size_t i) {
+        size_t dir_index = candidate_dir(i);
+        return dir_index < dir_count ? ctx.include_dirs[dir_index] / include_path : current_dir / include_path;
+    };
+
+    // Директории include, где по фильтру Блума файла точно нет, пропускаются
+    // без обращения к файловой системе
+    BloomIndex* bloom = ctx.options.bloom_index;
+    vector<bool> skipped(candidate_count, false);
+    auto ruled_out = [&](size_t i) {
+        size_t dir_index = candidate_dir(i);
+        skipped[i] = bloom && dir_index < dir_count && !bloom->MayContain(ctx.include_dirs[dir_index], include_path);
+        return skipped[i];
+    };
+
+    size_t hit = 0;
+    ProbePool* pool = ctx.options.probe_pool;
+    if (pool && candidate_count > 1) {
+        vector<path> candidates;
+        vector<size_t> indices;
+        candidates.reserve(candidate_count);
+        for (size_t i = 0; i < candidate_count; ++i) {
+            if (!ruled_out(i)) {
+                candidates.push_back(candidate(i));
+                indices.push_back(i);
+            }
+        }
+        size_t found = pool->FindFirst(candidates);
+        hit = found < indices.size() ? indices[found] : candidate_count;
+    } else {
+        while (hit < candidate_count && (ruled_out(hit) || !filesystem::exists(candidate(hit)))) {
+            ++hit;
+        }
+    }
+
+    // Проверки учитываются так, как если бы поиск шёл по очереди до первого
+    // совпадения, поэтому статистика и кэш не зависят от способа поиска
+    vector<path> probed_dirs;
+    for (size_t i = 0; i < candidate_count && i <= hit; ++i) {
+        if (cache) {
+            probed_dirs.push_back(candidate(i).parent_path());
+        }
+        if (stats && !skipped[i]) {
+            size_t dir_index = candidate_dir(i);
+            ++stats->probes;
+            ++stats->dirs[dir_index < dir_count ? ctx.dir_usage[dir_index] : stats->GetDirUsageIndex({})].probes;
+        }
+    }
+
+    if (hit == candidate_count) {
+        return false;
+    }
+    full_path = candidate(hit);
+    record_hit(candidate_dir(hit));
+    if (cache) {
+        cache->AddResolved(key, full_path, probed_dirs);
+    }
+    return true;
+}
+
+/**
+ * Ищет директиву #include в строке
+ * Директива может находиться в любом месте строки: "# include" с любыми
+ * пробелами, затем имя в кавычках или угловых скобках. Если в строке есть
+ * и "file.h", и <file.h>, приоритет у первой директивы с кавычками.
+ * Строка просматривается за линейное время при любой длине
+ *
+ * @param line - строка без перевода строки
+ * @param directive - найденная директива (заполняются local и name)
+ * @return true, если директива найдена
+ */
+bool FindIncludeDirective(string_view line, IncludeDirective& directive) {
+    static constexpr string_view kInclude = "include"sv;
+    auto is_space = [](char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    };
+
+    optional<string_view> global_name;
+    // После первой неудачи поиска закрывающего символа дальше искать его бессмысленно
+    bool quote_closable = true;
+    bool angle_closable = true;
+    for (size_t pos = line.find('#'); pos != string_view::npos; pos = line.find('#', pos + 1)) {
+        size_t i = pos + 1;
+        while (i < line.size() && is_space(line[i])) {
+            ++i;
+        }
+        if (line.compare(i, kInclude.size(), kInclude) != 0) {
+            continue;
+        }
+        i += kInclude.size();
+        while (i < line.size() && is_space(line[i])) {
+            ++i;
+        }
+        if (i >= line.size()) {
+            break;
+        }
+        if (line[i] == '"' && quote_closable) {
+            size_t close = line.find('"', i + 1);
+            if (close != string_view::npos) {
+                directive.local = true;
+                directive.name = string(line.substr(i + 1, close - i - 1));
+                return true;
+            }
+            quote_closable = false;
+        } else if (line[i] == '<' && angle_closable && !global_name) {
+            size_t close = line.find('>', i + 1);
+            if (close != string_view::npos) {
+                global_name = line.substr(i + 1, close - i - 1);
+            } else {
+                angle_closable = false;
+            }
+        }
+    }
+    if (global_name) {
+        directive.local = false;
+        directive.name = string(*global_name);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Передаёт файл в выход целиком через splice, если в нём нет директив
+ * Файл должен заканчиваться переводом строки: иначе построчная обработка
+ * добавила бы его, и результат отличался бы
+ *
+ * @param input - уже прочитанный файл с сохранённым дескриптором
+ *                (MappedFile::Descriptor); повторно файл не открывается
+ * @return true, если файл передан; false, если его нужно обработать построчно
+ */
+bool SpliceVerbatimFile(const path& current_file, const MappedFile& input, OutputSink& output,
+                        const PreprocessContext& ctx) {
+    if (input.Descriptor() < 0 || input.Data().empty()) {
+        return false;
+    }
+    EnterPhase(ctx, Phase::kScan);
+    const string_view text = input.Data();
+    bool verbatim = text.back() == '\n' && DetectEncoding(text) == TextEncoding::kUtf8 && !MayContainInclude(text);
+    // Нормализуемый текст передаётся целиком, только если менять в нём нечего
+    if (verbatim && ctx.options.normalize_text) {
+        verbatim = text.substr(0, kUtf8Bom.size()) != kUtf8Bom && FindByte(text, 0, '\r') == string_view::npos;
+    }
+    if (!verbatim) {
+        return false;
+    }
+    EnterPhase(ctx, Phase::kWrite);
+    output.SpliceFile(input.Descriptor(), text.size());
+    if (ctx.options.cache) {
+        ctx.options.cache->AddSummary(current_file, input.Stamp(), {}, static_cast<uint64_t>(text.size()));
+    }
+    return true;
+}
+
+/**
+ * Рекурсивно обрабатывает файл, разворачивая директивы #include
+ * 
+ * @param current_file - текущий обрабатываемый файл
+ * @param output - приёмник результата
+ * @param ctx - состояние обработки (директории include, параметры)
+ * @param source_file - исходный файл (для отображения ошибок)
+ * @param source_line - номер строки в исходном файле (для отображения ошибок)
+ * @return true в случае успеха, false при ошибке
+ */
+bool ProcessInclude(const path &current_file, OutputSink &output, const PreprocessContext &ctx, const path &source_file = "", int source_line = 0) {
+    // Попытка открыть текущий файл для чтения. Для вывода в канал дескриптор
+    // сохраняется: файл без директив передаётся через splice из него
+    EnterPhase(ctx, Phase::kRead);
+    MappedFile input(current_file, ctx.options.io_policy, output.CanSpliceFiles());
+    if (ctx.options.stats) {
+        ++ctx.options.stats->files_opened;
+        if (input.IsOpen()) {
+            size_t method = static_cast<size_t>(input.Method());
+            ++ctx.options.stats->reads[method];
+            ctx.options.stats->read_bytes[method] += input.Data().size();
+        }
+    }
+    if (!input.IsOpen()) {
+        // Вывод ошибки, если файл не найден
+        if (!source_file.empty()) {
+            cout << "unknown include file " << current_file.filename().string() 
+                 << " at file " << source_file.string() 
+                 << " at line " << source_line << endl;
+        }
+        return false;
+    }
+    if (ctx.read_files) {
+        ctx.read_files->push_back({current_file, input.Stamp()});
+    }
+    // Файл без директив передаётся в канал целиком, минуя буфер приёмника
+    if (SpliceVerbatimFile(current_file, input, output, ctx)) {
+        return true;
+    }
+    output.SetSource(current_file);
+
+    // Вывод строки (без '\n') и участка из целых строк с учётом нормализации
+    const bool normalize = ctx.options.normalize_text;
+    auto write_line = [&](string_view line) {
+        if (normalize && !line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        output.WriteLine(line);
+    };
+    auto write_span = [&](string_view span) {
+        if (normalize) {
+            WriteNormalized(output, span);
+        } else {
+            output.Write(span);
+        }
+    };
+
+    // Разворачивание одной директивы: поиск файла и рекурсивная обработка.
+    // Директива, оставляемая фильтром, выводится строкой line как есть
+    const IncludeFilter* filter = ctx.options.include_filter;
+    auto expand = [&](const IncludeDirective& directive, string_view line) {
+        if (filter && filter->Keeps(directive)) {
+            EnterPhase(ctx, Phase::kWrite);
+            write_line(line);
+            return true;
+        }
+
+        path full_path;
+        EnterPhase(ctx, Phase::kResolve);
+        // Ошибка, если файл не найден
+        if (!ResolveInclude(ctx, directive, current_file, full_path)) {
+            cout << "unknown include file " << directive.name 
+                 << " at file " << current_file.string() 
+                 << " at line " << directive.line << endl;
+            return false;
+        }
+        if (filter && filter->NeedsResolution() && filter->KeepsResolved(directive, full_path)) {
+            EnterPhase(ctx, Phase::kWrite);
+            write_line(line);
+            return true;
+        }
+
+        // Перед входом во включаемый файл поток может ненадолго уступить
+        // другой работе; она не учитывается в счётчиках этого файла
+        if (ctx.options.at_include_boundary) {
+            if (ctx.profiler) {
+                ctx.profiler->Flush();
+            }
+            ctx.options.at_include_boundary();
+            if (ctx.profiler) {
+                ctx.profiler->Restart();
+            }
+        }
+
+        // Рекурсивная обработка найденного файла, затем вывод снова идёт из текущего
+        bool success = ProcessInclude(full_path, output, ctx, current_file, directive.line);
+        output.SetSource(current_file);
+        return success;
+    };
+
+    // Строки - участки отображённого в память файла, они не копируются.
+    // BOM UTF-8 не относится к тексту: директивы ищутся после него, а в
+    // результат он попадает, только если текст не нормализуется
+    // Файлы UTF-16 перекодируются в UTF-8 целиком, дальше обработка общая
+    string_view text = input.Data();
+    TranscodedText transcoded;
+    if (TextEncoding encoding = DetectEncoding(text); encoding != TextEncoding::kUtf8) {
+        EnterPhase(ctx, Phase::kScan);
+        transcoded = TranscodeUtf16(text, encoding == TextEncoding::kUtf16Be);
+        text = transcoded.View();
+    }
+    if (text.substr(0, kUtf8Bom.size()) == kUtf8Bom) {
+        text.remove_prefix(kUtf8Bom.size());
+        if (!normalize) {
+            EnterPhase(ctx, Phase::kWrite);
+            output.Write(kUtf8Bom);
+        }
+    }
+    bool success = true;
+
+    // Если файл не менялся с прошлого просмотра, директивы берутся из сводки,
+    // а текст между ними копируется целиком, без разбиения на строки
+    IncludeCache* cache = ctx.options.cache;
+    shared_ptr<const DirectiveSummary> summary = cache ? cache->FindSummary(current_file, input.Stamp()) : nullptr;
+    if (summary && summary->Size() > 0 && summary->End(summary->Size() - 1) > text.size()) {
+        // Файл изменился уже во время запуска
+        summary = nullptr;
+    }
+    if (summary) {
+        size_t pos = 0;
+        for (size_t i = 0; success && i < summary->Size(); ++i) {
+            EnterPhase(ctx, Phase::kWrite);
+            write_span(text.substr(pos, summary->Begin(i) - pos));
+            success = expand({summary->Line(i), summary->IsLocal(i), string(summary->Name(i))},
+                             text.substr(summary->Begin(i), summary->End(i) - summary->Begin(i)));
+            pos = summary->End(i) + 1;
+        }
+        if (success && pos < text.size()) {
+            EnterPhase(ctx, Phase::kWrite);
+            if (text.back() == '\n') {
+                write_span(text.substr(pos));
+            } else {
+                // Последняя строка без перевода строки выводится как отдельная строка
+                size_t last_line = text.rfind('\n');
+                last_line = last_line == string_view::npos || last_line < pos ? pos : last_line + 1;
+                write_span(text.substr(pos, last_line - pos));
+                write_line(text.substr(last_line));
+            }
+        }
+        return success;
+    }
+
+    // Смещения хранятся в сводке 32-битными, для больших файлов она не строится
+    const bool summarize = cache && text.size() <= numeric_limits<uint32_t>::max();
+    vector<DirectiveSummary::Record> found_directives;
+    size_t line_start = 0;
+    int line_number = 0;
+
+    // Обработка файла построчно. Фаза переключается только на директивах:
+    // строки без них копируются в буфер приёмника сразу при просмотре и
+    // учитываются в kScan, иначе учёт на каждой строке стоил бы дороже самой
+    // строки. Запись заполненного буфера приёмник относит к kWrite
+    EnterPhase(ctx, Phase::kScan);
+    while (line_start < text.size()) {
+        size_t line_end = text.find('\n', line_start);
+        if (line_end == string_view::npos) {
+            line_end = text.size();
+        }
+        const string_view line = text.substr(line_start, line_end - line_start);
+        const size_t line_begin = line_start;
+        line_start = line_end + 1;
+        line_number++;
+
+        IncludeDirective directive;
+        // Если строка не содержит директиву include, копируем её как есть
+        if (!FindIncludeDirective(line, directive)) {
+            write_line(line);
+            continue;
+        }
+        directive.line = line_number;
+        if (summarize) {
+            found_directives.push_back({static_cast<uint32_t>(line_begin), static_cast<uint32_t>(line_end), directive});
+        }
+        if (!expand(directive, line)) {
+            success = false;
+            break;
+        }
+        EnterPhase(ctx, Phase::kScan);
+    }
+
+    // Сводка сохраняется только для файла, просмотренного до конца
+    if (success && summarize) {
+        cache->AddSummary(current_file, input.Stamp(), found_directives, text.size());
+    }
+
+    return success;
+}
+
+/**
+ * Обрабатывает входной файл, записывая результат в приёмник
+ *
+ * @param input_file - путь к входному файлу
+ * @param output - приёмник результата
+ * @param include_dirs - список директорий для поиска заголовочных файлов
+ * @param options - параметры препроцессинга
+ * @param read_files - если задан, сюда добавляются все прочитанные файлы с
+ *                     отметками прочитанных версий
+ * @return true в случае успеха, false при ошибке
+ */
+bool PreprocessToSink(const path& input_file, OutputSink& output, const vector<path>& include_dirs,
+                      const PreprocessOptions& options, vector<StampedFile>* read_files = nullptr) {
+    PreprocessContext ctx{include_dirs, options};
+    ctx.read_files = read_files;
+    if (options.cache) {
+        if (options.start_run) {
+            options.cache->StartRun();
+        }
+        ctx.dir_set_id = options.cache->GetDirSetId(include_dirs);
+    }
+    if (options.bloom_index && options.start_run) {
+        options.bloom_index->StartRun();
+    }
+    if (options.stats) {
+        for (const auto& dir : include_dirs) {
+            ctx.dir_usage.push_back(options.stats->GetDirUsageIndex(dir));
+        }
+    }
+
+    if (!options.stats) {
+        // Запуск обработки файла
+        bool success = ProcessInclude(input_file, output, ctx);
+        return output.Flush() && success;
+    }
+
+    // Запуск обработки файла с учётом счётчиков по фазам
+    PreprocessStats::Unit unit{input_file, {}};
+    bool success;
+    {
+        PhaseProfiler profiler(unit.phases);
+        ctx.profiler = &profiler;
+        output.SetProfiler(&profiler);
+        success = ProcessInclude(input_file, output, ctx);
+        EnterPhase(ctx, Phase::kWrite);
+        success = output.Flush() && success;
+        output.SetProfiler(nullptr);
+        profiler.Flush();
+        options.stats->hw_counters = options.stats->hw_counters || profiler.HasHardwareCounters();
+    }
+    for (size_t i = 0; i < kPhaseCount; ++i) {
+        options.stats->total[i] += unit.phases[i];
+    }
+    options.stats->units.push_back(move(unit));
+    return success;
+}
+
+/**
+ * Главная функция препроцессинга
+ * Обрабатывает входной файл и создаёт выходной файл с развёрнутыми include
+ * 
+ * @param input_file - путь к входному файлу
+ * @param output_file - путь к выходному файлу
+ * @param include_dirs - список директорий для поиска заголовочных файлов
+ * @param options - параметры препроцессинга
+ * @param read_files - если задан, сюда добавляются все прочитанные файлы с
+ *                     отметками прочитанных версий
+ * @return true в случае успеха, false при ошибке
+ */
+bool Preprocess(const path& input_file, const path& output_file, const vector<path>& include_dirs,
+                const PreprocessOptions& options = {}, vector<StampedFile>* read_files = nullptr) {
+    // Проверка возможности открытия входного файла
+    ifstream input(input_file);
+    if (!input.is_open()) {
+        cout << "Ошибка: Не удалось открыть входной файл: " << input_file.string() << endl;
+        return false;
+    }
+
+    // Проверка возможности создания выходного файла (или первой части результата)
+    optional<OutputChunks> chunks;
+    if (options.chunk_size != 0) {
+        chunks.emplace(output_file, options.chunk_size);
+    }
+    const path& first_file = chunks ? chunks->StartChunk() : output_file;
+    OutputSink output(first_file);
+    if (!output.IsOpen()) {
+        cout << "Ошибка: Не удалось открыть выходной файл: " << first_file.string() << endl;
+        return false;
+    }
+    if (chunks) {
+        output.SetChunks(&*chunks);
+    }
+
+    if (options.line_index_interval == 0 && !chunks) {
+        return PreprocessToSink(input_file, output, include_dirs, options, read_files);
+    }
+
+    // Индекс строк и манифест частей строятся по ходу записи
+    // и сохраняются после успешной обработки
+    optional<LineIndex> line_index;
+    if (options.line_index_interval != 0) {
+        line_index.emplace(options.line_index_interval);
+        output.SetLineIndex(&*line_index);
+    }
+    if (!PreprocessToSink(input_file, output, include_dirs, options, read_files)) {
+        return false;
+    }
+    if (line_index && !line_index->SaveTo(GetLineIndexPath(output_file))) {
+        cout << "Ошибка: Не удалось записать индекс строк: " << GetLineIndexPath(output_file).string() << endl;
+        return false;
+    }
+    if (chunks && !chunks->SaveManifest()) {
+        cout << "Ошибка: Не удалось записать манифест: "
+             << OutputChunks::GetManifestPath(output_file).string() << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Хранилище результатов по содержимому
+ * Каждый уникальный результат хранится один раз под именем из хеша
+ * содержимого, а выходные файлы заданий становятся жёсткими ссылками на
+ * него (или reflink-копиями, если ссылку создать нельзя). Так тысячи
+ * одинаковых результатов занимают место одного файла
+ *
+ * Выходные файлы делят inode с хранимым результатом, поэтому изменять их
+ * на месте нельзя: правка затронет все одинаковые результаты. Хранилище
+ * сообщает inode своих результатов StoredBlobs, и OutputSink перед записью
+ * удаляет такой файл и создаёт новый
+ */
+class OutputStore {
+public:
+    /**
+     * @param root - директория хранилища; должна быть на той же файловой
+     *               системе, что и выходные файлы, иначе они копируются
+     */
+    explicit OutputStore(path root) : root_(move(root)) {
+        error_code err;
+        filesystem::create_directories(root_ / "tmp"_p, err);
+#if defined(__unix__) || defined(__APPLE__)
+        // Результаты прошлых запусков: на них могут ссылаться выходные файлы
+        for (filesystem::directory_iterator it(root_, err), end; !err && it != end; it.increment(err)) {
+            struct stat st;
+            if (stat(it->path().c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                StoredBlobs::Add(st);
+            }
+        }
+#endif
+    }
+
+    OutputStore(const OutputStore&) = delete;
+    OutputStore& operator=(const OutputStore&) = delete;
+
+    /**
+     * Возвращает новое имя для записи результата перед добавлением в хранилище
+     */
+    path MakeTempFile() {
+        ostringstream name;
+        name << chrono::system_clock::now().time_since_epoch().count() << '-' << this_thread::get_id() << '-'
+             << temp_counter_++;
+        return root_ / "tmp"_p / name.str();
+    }
+
+    /**
+     * Переносит записанный результат в хранилище
+     * Если такой результат уже хранится, файл удаляется. Хранимый результат
+     * с тем же хешем используется, только если совпадает побайтно; при
+     * совпадении хешей разных результатов к имени добавляется номер
+     *
+     * @param file - файл из MakeTempFile
+     * @return путь к хранимому результату или nullopt при ошибке
+     */
+    optional<path> Add(const path& file) {
+        MappedFile mapped(file);
+        if (!mapped.IsOpen()) {
+            return nullopt;
+        }
+        const string_view data = mapped.Data();
+        ostringstream name;
+        name << hex << setfill('0') << setw(16) << HashString(data) << setw(16)
+             << HashString(data, kSecondSeed) << '-' << dec << data.size();
+
+        // Хранимый результат запоминается до того, как на него сошлётся выходной файл
+        auto remember = [](const path& blob) {
+#if defined(__unix__) || defined(__APPLE__)
+            struct stat st;
+            if (stat(blob.c_str(), &st) == 0) {
+                StoredBlobs::Add(st);
+            }
+#else
+            (void)blob;
+#endif
+            return blob;
+        };
+        for (size_t collision = 0;; ++collision) {
+            path blob = root_ / (collision == 0 ? name.str() : name.str() + "-" + to_string(collision));
+            // Ссылка, в отличие от переименования, не заменяет существующий файл,
+            // поэтому одновременно добавленные одинаковые результаты дают один файл
+            error_code err;
+            filesystem::create_hard_link(file, blob, err);
+            if (err == errc::file_exists) {
+                MappedFile stored(blob);
+                if (!stored.IsOpen() || stored.Data() != data) {
+                    continue;
+                }
+                ++reused_;
+            } else if (err) {
+                filesystem::rename(file, blob, err);
+                if (err) {
+                    return nullopt;
+                }
+                ++stored_;
+                return remember(blob);
+            } else {
+                ++stored_;
+            }
+            filesystem::remove(file, err);
+            return remember(blob);
+        }
+    }
+
+    /**
+     * Создаёт или заменяет output_file ссылкой на source
+     * Если жёсткую ссылку создать нельзя, пробует reflink, затем копирование
+     *
+     * @return true в случае успеха
+     */
+    static bool Materialize(const path& source, const path& output_file) {
+        path tmp_file = output_file;
+        tmp_file += ".link";
+        error_code err;
+        filesystem::remove(tmp_file, err);
+        filesystem::create_hard_link(source, tmp_file, err);
+        if (err && !Clone(source, tmp_file)) {
+            filesystem::copy_file(source, tmp_file, filesystem::copy_options::overwrite_existing, err);
+            if (err) {
+                return false;
+            }
+        }
+        filesystem::rename(tmp_file, output_file, err);
+        return !err;
+    }
+
+    /**
+     * Сколько уникальных результатов добавлено в хранилище
+     */
+    size_t GetStoredCount() const {
+        return stored_;
+    }
+
+    /**
+     * Сколько результатов совпали с уже хранимыми
+     */
+    size_t GetReusedCount() const {
+        return reused_;
+    }
+
+private:
+    static constexpr uint64_t kSecondSeed = 0x9e3779b97f4a7c15ull;
+
+    // Копирует файл через FICLONE: блоки данных общие до первой записи
+    static bool Clone(const path& source, const path& target) {
+#if defined(__linux__) && defined(FICLONE)
+        int source_fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (source_fd < 0) {
+            return false;
+        }
+        int target_fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool cloned = target_fd >= 0 && ioctl(target_fd, FICLONE, source_fd) == 0;
+        if (target_fd >= 0) {
+            close(target_fd);
+        }
+        close(source_fd);
+        if (!cloned) {
+            error_code err;
+            filesystem::remove(target, err);
+        }
+        return cloned;
+#else
+        (void)source;
+        (void)target;
+        return false;
+#endif
+    }
+
+    path root_;
+    atomic<size_t> temp_counter_ = 0;
+    atomic<size_t> stored_ = 0;
+    atomic<size_t> reused_ = 0;
+};
+
+/**
+ * Гистограмма задержек по степеням двойки в микросекундах
+ * Запись не блокирует, поэтому гистограмму можно читать во время работы
+ */
+class LatencyHistogram {
+public:
+    void Record(chrono::nanoseconds latency) {
+        uint64_t micros = static_cast<uint64_t>(max<int64_t>(0, chrono::duration_cast<chrono::microseconds>(latency).count()));
+        size_t bucket = 0;
+        while (bucket + 1 < kBuckets && (micros >> bucket) > 1) {
+            ++bucket;
+        }
+        buckets_[bucket].fetch_add(1, memory_order_relaxed);
+    }
+
+    /**
+     * Выводит непустые корзины в виде "<до_мкс> <число>"
+     */
+    void Print(ostream& out, const string& name) const {
+        out << name << '\n';
+        for (size_t i = 0; i < kBuckets; ++i) {
+            uint64_t count = buckets_[i].load(memory_order_relaxed);
+            if (count > 0) {
+                out << "  <" << (uint64_t{2} << i) << "us " << count << '\n';
+            }
+        }
+    }
+
+private:
+    static constexpr size_t kBuckets = 40;
+    array<atomic<uint64_t>, kBuckets> buckets_ = {};
+};
+
+/**
+ * Приоритет задания пакетной обработки
+ */
+enum class JobPriority {
+    kInteractive, // срочное задание (например, от IDE): выполняется сразу
+    kBatch,       // фоновое задание
+};
+
+/**
+ * Задание на препроцессинг одного входного файла
+ */
+struct PreprocessJob {
+    path input_file;
+    path output_file;
+    vector<path> include_dirs;
+};
+
+/**
+ * Движок пакетной обработки
+ * Задания проходят две стадии. Потоки ввода-вывода заранее подгружают
+ * в страничный кэш файлы задания (входной файл и всё, что он читал при
+ * прошлой обработке; для задания, которое движок ещё не выполнял, -
+ * включения из графа в options.cache, в том числе загруженного из
+ * снимка), а рабочие потоки разворачивают include уже по
+ * горячему кэшу. Так немногие рабочие потоки не простаивают на чтении,
+ * пока сотни заданий ждут своих файлов на медленном хранилище
+ *
+ * Это не асинхронный конвейер: подгрузка - лишь подсказка ядру
+ * (POSIX_FADV_WILLNEED), а задание разворачивается рабочим потоком от
+ * начала до конца и блокирует его на чтении, если файл ещё не дошёл до
+ * кэша. Разворачивается одновременно не больше заданий, чем рабочих
+ * потоков; «в полёте» остальные задания только своими запросами чтения.
+ * Приостановка задания на чтении с продолжением в другом потоке
+ * (сопрограммы поверх io_uring или потока ввода-вывода) не реализована:
+ * для этого рекурсивный ProcessInclude пришлось бы переписать в явный
+ * стек состояний. Сколько заданий подгрузка опережает, показывает
+ * TakePeakPrefetched и бенчмарк RunPrefetchBenchmark
+ *
+ * Кэш и пул из options общие для всех заданий; статистика каждого задания
+ * собирается отдельно и добавляется в options.stats. Задания, отправленные,
+ * пока движок занят, составляют один пакет и один запуск кэша и фильтров:
+ * каждая запись проверяется на пакет один раз. Новый запуск начинается с
+ * первым заданием после простоя
+ *
+ * Срочные задания минуют стадию подгрузки и стоят в отдельной очереди,
+ * которую рабочие потоки разбирают первой. Фоновое задание на каждой
+ * границе include проверяет эту очередь и, если она не пуста, выполняет
+ * срочные задания в своём потоке, а затем продолжает работу
+ *
+ * Одинаковые задания (тот же входной файл и директории include), пока
+ * первое из них не завершено, не выполняются повторно: они получают его
+ * результат, а выходной файл копируется
+ *
+ * С хранилищем результатов (OutputStore) результат каждого задания сначала
+ * попадает в хранилище, а выходной файл становится ссылкой на хранимый
+ * результат; одинаковые результаты разных заданий хранятся один раз
+ *
+ * У каждого рабочего потока своя очередь. Задание ставится в очередь потока,
+ * которому недавно достались задания с теми же файлами: их заголовки ещё в
+ * кэше ядра этого потока. Файлы задания известны из его прошлого выполнения
+ * этим движком, а для нового задания - из графа включений кэша (IncludeCache).
+ * Поток с пустой очередью забирает задания из самой длинной чужой очереди
+ */
+class PreprocessEngine {
+public:
+    /**
+     * @param workers - число рабочих потоков; 0 считается за 1, иначе задания некому выполнять
+     * @param io_threads - число потоков подгрузки файлов
+     * @param options - параметры препроцессинга для всех заданий
+     * @param output_store - хранилище результатов; nullptr - писать выходные файлы напрямую
+     * @param cache_affinity - распределять задания по общим файлам; false - в наименее
+     *                         загруженный поток
+     */
+    PreprocessEngine(size_t workers, size_t io_threads, const PreprocessOptions& options = {},
+                     OutputStore* output_store = nullptr, bool cache_affinity = true)
+        : options_(options), output_store_(output_store), prefetch_stage_(io_threads > 0),
+          cache_affinity_(cache_affinity), work_queues_(max<size_t>(workers, 1)),
+          hot_files_(work_queues_.size()), worker_files_(work_queues_.size()) {
+        for (size_t i = 0; i < io_threads; ++i) {
+            threads_.emplace_back([this]() {
+                PrefetchLoop();
+            });
+        }
+        for (size_t i = 0; i < work_queues_.size(); ++i) {
+            threads_.emplace_back([this, i]() {
+                WorkLoop(i);
+            });
+        }
+    }
+
+    /**
+     * Дожидается выполнения всех отправленных заданий
+     */
+    ~PreprocessEngine() {
+        {
+            lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        prefetch_cv_.notify_all();
+        work_cv_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    PreprocessEngine(const PreprocessEngine&) = delete;
+    PreprocessEngine& operator=(const PreprocessEngine&) = delete;
+
+    /**
+     * Ставит задание в очередь
+     *
+     * @param job - задание
+     * @param priority - приоритет задания
+     * @return результат, как у Preprocess
+     */
+    future<bool> Submit(PreprocessJob job, JobPriority priority = JobPriority::kBatch) {
+        string key = GetJobKey(job);
+        unique_lock lock(mutex_);
+
+        // Такое же задание уже выполняется или ждёт в очереди: новое не
+        // запускается, а получает его результат (копию выходного файла)
+        auto it = in_flight_.find(key);
+        if (it != in_flight_.end()) {
+            Follower follower{move(job.output_file), {}};
+            future<bool> result = follower.result.get_future();
+            it->second.followers.push_back(move(follower));
+            if (priority == JobPriority::kInteractive && !it->second.started) {
+                PromoteLocked(key);
+            }
+            lock.unlock();
+            work_cv_.notify_one();
+            return result;
+        }
+        if (in_flight_.empty()) {
+            // Движок простаивал: изменения файлов с прошлого пакета должны быть видны
+            if (options_.cache) {
+                options_.cache->StartRun();
+            }
+            if (options_.bloom_index) {
+                options_.bloom_index->StartRun();
+            }
+        }
+        in_flight_[key];
+
+        Task task{move(job), move(key), {}, {}};
+        future<bool> result = task.result.get_future();
+        if (priority == JobPriority::kInteractive) {
+            interactive_queue_.push_back(move(task));
+            ++interactive_pending_;
+            lock.unlock();
+            work_cv_.notify_one();
+            return result;
+        }
+        if (prefetch_stage_) {
+            prefetch_queue_.push_back(move(task));
+            lock.unlock();
+            prefetch_cv_.notify_one();
+        } else {
+            // Файлы задания, которого движок ещё не видел, берутся из графа кэша.
+            // Обход проверяет файлы и директории, поэтому идёт без блокировки
+            if (cache_affinity_ && work_queues_.size() > 1 && options_.cache
+                && read_files_.find(task.key) == read_files_.end()) {
+                lock.unlock();
+                task.files = options_.cache->CollectIncludes(task.job.input_file,
+                                                             options_.cache->GetDirSetId(task.job.include_dirs));
+                lock.lock();
+            }
+            EnqueueWorkLocked(move(task));
+            lock.unlock();
+            work_cv_.notify_all();
+        }
+        return result;
+    }
+
+    /**
+     * Выводит текущее состояние: счётчики заданий, очереди, выполняемые
+     * задания, гистограммы задержек, статистику и заполненность кэша
+     * Блокировки удерживаются только на время копирования состояния
+     */
+    void DumpStatus(ostream& out) {
+        const auto now = chrono::steady_clock::now();
+        vector<pair<string, int64_t>> running;
+        size_t queued = 0;
+        size_t prefetching = 0;
+        size_t interactive = 0;
+        PreprocessStats stats;
+        {
+            lock_guard lock(mutex_);
+            queued = work_queued_;
+            prefetching = prefetch_queue_.size() + prefetch_busy_;
+            interactive = interactive_queue_.size();
+            for (const auto& [key, entry] : in_flight_) {
+                if (entry.started) {
+                    auto elapsed = chrono::duration_cast<chrono::milliseconds>(now - entry.started_at).count();
+                    running.emplace_back(key.substr(0, key.find('\n')), elapsed);
+                }
+            }
+            if (options_.stats) {
+                stats = options_.stats->GetTotals();
+            }
+        }
+
+        out << "jobs done=" << jobs_done_.load(memory_order_relaxed)
+            << " failed=" << jobs_failed_.load(memory_order_relaxed) << " queued=" << queued
+            << " prefetching=" << prefetching << " interactive=" << interactive << '\n';
+        out << "in_flight " << running.size() << '\n';
+        for (const auto& [input_file, elapsed_ms] : running) {
+            out << "  " << input_file << " running_ms=" << elapsed_ms << '\n';
+        }
+        latency_.Print(out, "latency");
+        run_time_.Print(out, "run_time");
+        if (options_.cache) {
+            IncludeCache::Occupancy occupancy = options_.cache->GetOccupancy();
+            out << "cache resolutions=" << occupancy.resolutions << " summaries=" << occupancy.summaries
+                << " dir_stamps=" << occupancy.stamps << " checks=" << occupancy.checks << '\n';
+        }
+        if (options_.stats) {
+            stats.Print(out);
+        }
+    }
+
+    /**
+     * Сумма по рабочим потокам числа различных файлов, прочитанных заданиями
+     * потока с прошлого вызова. Чем меньше, тем лучше задания с общими
+     * заголовками собраны в одних потоках
+     */
+    size_t TakeWorkerFootprint() {
+        lock_guard lock(mutex_);
+        size_t footprint = 0;
+        for (auto& files : worker_files_) {
+            footprint += files.size();
+            files.clear();
+        }
+        return footprint;
+    }
+
+    /**
+     * Наибольшее с прошлого вызова число заданий, файлы которых уже
+     * запрошены стадией подгрузки и которые ждут рабочего потока
+     */
+    size_t TakePeakPrefetched() {
+        lock_guard lock(mutex_);
+        return exchange(peak_prefetched_, 0);
+    }
+
+    /**
+     * Входные файлы заданий, ждущих в очередях рабочих потоков, по потокам
+     */
+    vector<vector<path>> GetQueuedInputs() {
+        lock_guard lock(mutex_);
+        vector<vector<path>> inputs(work_queues_.size());
+        for (size_t i = 0; i < work_queues_.size(); ++i) {
+            for (const auto& task : work_queues_[i]) {
+                inputs[i].push_back(task.job.input_file);
+            }
+        }
+        return inputs;
+    }
+
+private:
+    struct Task {
+        PreprocessJob job;
+        string key; // ключ из GetJobKey
+        promise<bool> result;
+        vector<path> files; // файлы из графа кэша, если движок ещё не выполнял задание
+        chrono::steady_clock::time_point submitted = chrono::steady_clock::now();
+    };
+
+    // Задание, присоединившееся к такому же выполняющемуся
+    struct Follower {
+        path output_file;
+        promise<bool> result;
+    };
+
+    // Выполняемое или ожидающее задание и присоединившиеся к нему
+    struct InFlight {
+        bool started = false;
+        chrono::steady_clock::time_point started_at;
+        vector<Follower> followers;
+    };
+
+    // Отмечает начало выполнения задания
+    void StartLocked(const string& key) {
+        InFlight& entry = in_flight_[key];
+        entry.started = true;
+        entry.started_at = chrono::steady_clock::now();
+    }
+
+    // Переносит ещё не начатое задание в очередь срочных
+    void PromoteLocked(const string& key) {
+        auto promote = [&](deque<Task>& queue) {
+            for (auto it = queue.begin(); it != queue.end(); ++it) {
+                if (it->key == key) {
+                    interactive_queue_.push_back(move(*it));
+                    queue.erase(it);
+                    ++interactive_pending_;
+                    return true;
+                }
+            }
+            return false;
+        };
+        for (auto& queue : work_queues_) {
+            if (promote(queue)) {
+                --work_queued_;
+                return;
+            }
+        }
+        promote(prefetch_queue_);
+    }
+
+    // Ставит задание в очередь рабочего потока: того, кому недавно достались
+    // задания с теми же файлами, если его очередь не слишком длинная. Задание
+    // без общих файлов получает поток с наименьшим набором недавних файлов,
+    // чтобы разные группы заданий расходились по разным потокам. Файлы берутся
+    // из прошлого выполнения задания, а без него - из графа кэша (Task::files)
+    void EnqueueWorkLocked(Task task) {
+        size_t worker = 0;
+        for (size_t i = 1; i < work_queues_.size(); ++i) {
+            if (work_queues_[i].size() < work_queues_[worker].size()) {
+                worker = i;
+            }
+        }
+
+        auto it = read_files_.find(task.key);
+        const vector<path>& files = it != read_files_.end() ? it->second : task.files;
+        if (cache_affinity_ && !files.empty()) {
+            vector<size_t> hashes;
+            hashes.reserve(files.size());
+            for (const auto& file : files) {
+                hashes.push_back(hash<string>{}(file.string()));
+            }
+            const size_t least_loaded = work_queues_[worker].size();
+            size_t best_overlap = 0;
+            for (size_t i = 0; i < work_queues_.size(); ++i) {
+                if (work_queues_[i].size() > least_loaded + kMaxImbalance) {
+                    continue;
+                }
+                size_t overlap = 0;
+                for (size_t file_hash : hashes) {
+                    overlap += hot_files_[i].count(file_hash);
+                }
+                if (overlap > best_overlap
+                    || (best_overlap == 0 && overlap == 0 && hot_files_[i].size() < hot_files_[worker].size())) {
+                    best_overlap = overlap;
+                    worker = i;
+                }
+            }
+            // Набор недавних файлов потока ограничен, как и его кэш
+            if (hot_files_[worker].size() + hashes.size() > kHotFilesLimit) {
+                hot_files_[worker].clear();
+            }
+            hot_files_[worker].insert(hashes.begin(), hashes.end());
+        }
+
+        work_queues_[worker].push_back(move(task));
+        ++work_queued_;
+    }
+
+    // Берёт задание из своей очереди или, если она пуста, из самой длинной чужой
+    Task TakeWorkLocked(size_t worker) {
+        size_t source = worker;
+        if (work_queues_[worker].empty()) {
+            for (size_t i = 0; i < work_queues_.size(); ++i) {
+                if (work_queues_[i].size() > work_queues_[source].size()) {
+                    source = i;
+                }
+            }
+        }
+        deque<Task>& queue = work_queues_[source];
+        Task task = move(source == worker ? queue.front() : queue.back());
+        source == worker ? queue.pop_front() : queue.pop_back();
+        --work_queued_;
+        return task;
+    }
+
+    // Отдаёт результат задания ему и присоединившимся заданиям
+    void Finish(Task& task, bool success) {
+        vector<Follower> followers;
+        {
+            lock_guard lock(mutex_);
+            auto it = in_flight_.find(task.key);
+            followers = move(it->second.followers);
+            in_flight_.erase(it);
+        }
+        latency_.Record(chrono::steady_clock::now() - task.submitted);
+        (success ? jobs_done_ : jobs_failed_).fetch_add(1, memory_order_relaxed);
+        task.result.set_value(success);
+        // Присоединившееся задание успешно, только если его копия результата записана
+        for (auto& follower : followers) {
+            bool follower_success = success;
+            if (success && follower.output_file != task.job.output_file) {
+                follower_success = CopyResult(task.job.output_file, follower.output_file);
+            }
+            (follower_success ? jobs_done_ : jobs_failed_).fetch_add(1, memory_order_relaxed);
+            follower.result.set_value(follower_success);
+        }
+    }
+
+    /**
+     * Копирует результат задания для присоединившегося к нему задания:
+     * выходной файл (или части с манифестом) и индекс строк, если он строится
+     */
+    bool CopyResult(const path& from, const path& to) const {
+        // Прежний файл удаляется: он может быть ссылкой на результат в хранилище
+        auto copy = [](const path& source, const path& target) {
+            error_code err;
+            filesystem::remove(target, err);
+            filesystem::copy_file(source, target, err);
+            return !err;
+        };
+        bool success;
+        if (options_.chunk_size != 0) {
+            success = OutputChunks::CopyChunks(from, to, copy);
+        } else if (output_store_) {
+            success = OutputStore::Materialize(from, to);
+        } else {
+            success = copy(from, to);
+        }
+        if (success && options_.line_index_interval != 0) {
+            success = copy(GetLineIndexPath(from), GetLineIndexPath(to));
+        }
+        return success;
+    }
+
+    // Ключ задания для запоминания прочитанных файлов
+    static string GetJobKey(const PreprocessJob& job) {
+        string key = job.input_file.string();
+        for (const auto& dir : job.include_dirs) {
+            key += '\n' + dir.string();
+        }
+        return key;
+    }
+
+    // Просит ядро заранее прочитать файл в страничный кэш
+    static void Prefetch(const path& file) {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+        close(fd);
+#else
+        (void)file;
+#endif
+    }
+
+    void PrefetchLoop() {
+        while (true) {
+            Task task;
+            vector<path> files;
+            {
+                unique_lock lock(mutex_);
+                prefetch_cv_.wait(lock, [this]() {
+                    return stop_ || !prefetch_queue_.empty();
+                });
+                if (prefetch_queue_.empty()) {
+                    return;
+                }
+                task = move(prefetch_queue_.front());
+                prefetch_queue_.pop_front();
+                ++prefetch_busy_;
+                auto it = read_files_.find(task.key);
+                if (it != read_files_.end()) {
+                    files = it->second;
+                }
+            }
+
+            // Обход графа проверяет файлы и директории, поэтому идёт без блокировки
+            IncludeCache* cache = options_.cache;
+            if (files.empty() && cache) {
+                files = cache->CollectIncludes(task.job.input_file, cache->GetDirSetId(task.job.include_dirs));
+            }
+            Prefetch(task.job.input_file);
+            for (const auto& file : files) {
+                Prefetch(file);
+            }
+            task.files = move(files);
+
+            {
+                lock_guard lock(mutex_);
+                EnqueueWorkLocked(move(task));
+                peak_prefetched_ = max(peak_prefetched_, work_queued_);
+                --prefetch_busy_;
+            }
+            work_cv_.notify_all();
+        }
+    }
+
+    void WorkLoop(size_t worker) {
+        while (true) {
+            Task task;
+            bool interactive = false;
+            {
+                unique_lock lock(mutex_);
+                // Рабочие потоки завершаются, только когда стадия подгрузки опустела
+                work_cv_.wait(lock, [this]() {
+                    return !interactive_queue_.empty() || work_queued_ > 0
+                           || (stop_ && prefetch_queue_.empty() && prefetch_busy_ == 0);
+                });
+                if (!interactive_queue_.empty()) {
+                    task = move(interactive_queue_.front());
+                    interactive_queue_.pop_front();
+                    --interactive_pending_;
+                    interactive = true;
+                } else if (work_queued_ > 0) {
+                    task = TakeWorkLocked(worker);
+                } else {
+                    return;
+                }
+                StartLocked(task.key);
+            }
+            Finish(task, Run(task.job, interactive, worker));
+        }
+    }
+
+    // Выполняет в текущем потоке все ожидающие срочные задания
+    void RunInteractive(size_t worker) {
+        while (interactive_pending_.load(memory_order_relaxed) > 0) {
+            Task task;
+            {
+                lock_guard lock(mutex_);
+                if (interactive_queue_.empty()) {
+                    return;
+                }
+                task = move(interactive_queue_.front());
+                interactive_queue_.pop_front();
+                --interactive_pending_;
+                StartLocked(task.key);
+            }
+            Finish(task, Run(task.job, true, worker));
+        }
+    }
+
+    bool Run(const PreprocessJob& job, bool interactive, size_t worker) {
+        PreprocessOptions options = options_;
+        options.start_run = false;
+        PreprocessStats stats;
+        options.stats = options_.stats ? &stats : nullptr;
+        if (!interactive) {
+            options.at_include_boundary = [this, worker]() {
+                RunInteractive(worker);
+            };
+        }
+        vector<StampedFile> read_files;
+
+        auto started = chrono::steady_clock::now();
+        bool success;
+        // Результат частями хранилище не принимает: части пишутся сразу на место
+        if (output_store_ && options.chunk_size == 0) {
+            path tmp_file = output_store_->MakeTempFile();
+            success = Preprocess(job.input_file, tmp_file, job.include_dirs, options, &read_files);
+            optional<path> blob = success ? output_store_->Add(tmp_file) : nullopt;
+            success = blob && OutputStore::Materialize(*blob, job.output_file);
+            if (success && options.line_index_interval != 0) {
+                // Индекс строк не хранится в хранилище и переносится к результату
+                error_code err;
+                filesystem::rename(GetLineIndexPath(tmp_file), GetLineIndexPath(job.output_file), err);
+                success = !err;
+            }
+            if (!blob) {
+                error_code err;
+                filesystem::remove(tmp_file, err);
+                filesystem::remove(GetLineIndexPath(tmp_file), err);
+            }
+        } else {
+            success = Preprocess(job.input_file, job.output_file, job.include_dirs, options, &read_files);
+        }
+
+        run_time_.Record(chrono::steady_clock::now() - started);
+
+        vector<path> files;
+        for (auto& read_file : read_files) {
+            files.push_back(move(read_file.file));
+        }
+        lock_guard lock(mutex_);
+        for (const auto& file : files) {
+            worker_files_[worker].insert(hash<string>{}(file.string()));
+        }
+        // Запоминаются файлы последних kReadFilesLimit заданий
+        string key = GetJobKey(job);
+        if (read_files_.insert_or_assign(key, move(files)).second) {
+            read_files_order_.push_back(move(key));
+            if (read_files_order_.size() > kReadFilesLimit) {
+                read_files_.erase(read_files_order_.front());
+                read_files_order_.pop_front();
+            }
+        }
+        if (options_.stats) {
+            options_.stats->Merge(stats);
+        }
+        return success;
+    }
+
+    static constexpr size_t kMaxImbalance = 8;      // на сколько заданий очередь может превышать кратчайшую
+    static constexpr size_t kHotFilesLimit = 4096;  // сколько недавних файлов помнится для потока
+    static constexpr size_t kReadFilesLimit = 4096; // для скольких заданий помнятся прочитанные файлы
+
+    const PreprocessOptions options_;
+    OutputStore* const output_store_;
+    const bool prefetch_stage_;
+    const bool cache_affinity_;
+
+    mutex mutex_;
+    condition_variable prefetch_cv_;
+    condition_variable work_cv_;
+    deque<Task> prefetch_queue_;
+    vector<deque<Task>> work_queues_; // по одной на рабочий поток
+    size_t work_queued_ = 0;          // заданий во всех work_queues_
+    vector<unordered_set<size_t>> hot_files_;    // хеши файлов заданий, недавно поставленных потоку
+    vector<unordered_set<size_t>> worker_files_; // хеши файлов, прочитанных в потоке, для TakeWorkerFootprint
+    atomic<uint64_t> jobs_done_ = 0;
+    atomic<uint64_t> jobs_failed_ = 0;
+    LatencyHistogram latency_;  // от отправки задания до результата
+    LatencyHistogram run_time_; // выполнение задания рабочим потоком
+    deque<Task> interactive_queue_;
+    atomic<size_t> interactive_pending_ = 0; // размер interactive_queue_ для проверки без блокировки
+    size_t prefetch_busy_ = 0;
+    size_t peak_prefetched_ = 0; // для TakePeakPrefetched
+    bool stop_ = false;
+    unordered_map<string, vector<path>> read_files_; // файлы, прочитанные заданием, по ключу GetJobKey
+    deque<string> read_files_order_;                 // ключи read_files_ в порядке добавления
+    unordered_map<string, InFlight> in_flight_;
+    vector<thread> threads_;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+/**
+ * Сброс состояния в файл по сигналу SIGUSR1
+ * Обработчик сигнала только пишет байт в канал (self-pipe), а файл
+ * формирует отдельный поток, поэтому рабочие потоки не останавливаются.
+ * Несколько сигналов подряд могут дать один сброс
+ * Одновременно может существовать только один объект
+ */
+class StatsDumper {
+public:
+    /**
+     * @param dump_file - файл для сброса; заменяется атомарно
+     * @param dump - выводит текущее состояние; вызывается в потоке сброса
+     */
+    StatsDumper(path dump_file, function<void(ostream&)> dump)
+        : dump_file_(move(dump_file)), dump_(move(dump)) {
+        if (pipe(pipe_) != 0) {
+            pipe_[0] = pipe_[1] = -1;
+            return;
+        }
+        for (int fd : pipe_) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        // Переполненный канал означает, что сброс и так предстоит
+        fcntl(pipe_[1], F_SETFL, fcntl(pipe_[1], F_GETFL) | O_NONBLOCK);
+        signal_fd_ = pipe_[1];
+
+        struct sigaction action {};
+        action.sa_handler = OnSignal;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, &previous_);
+
+        thread_ = thread([this]() {
+            Loop();
+        });
+    }
+
+    ~StatsDumper() {
+        if (pipe_[1] < 0) {
+            return;
+        }
+        sigaction(SIGUSR1, &previous_, nullptr);
+        signal_fd_ = -1;
+        char stop = kStop;
+        while (write(pipe_[1], &stop, 1) < 0 && errno == EINTR) {
+        }
+        thread_.join();
+        close(pipe_[0]);
+        close(pipe_[1]);
+    }
+
+    StatsDumper(const StatsDumper&) = delete;
+    StatsDumper& operator=(const StatsDumper&) = delete;
+
+    /**
+     * Число выполненных сбросов
+     */
+    size_t GetDumpCount() const {
+        return dumps_;
+    }
+
+private:
+    static constexpr char kDump = 'd';
+    static constexpr char kStop = 'q';
+
+    static void OnSignal(int) {
+        int saved_errno = errno;
+        int fd = signal_fd_;
+        if (fd >= 0) {
+            char byte = kDump;
+            [[maybe_unused]] ssize_t n = write(fd, &byte, 1);
+        }
+        errno = saved_errno;
+    }
+
+    void Loop() {
+        char byte;
+        while (true) {
+            ssize_t n = read(pipe_[0], &byte, 1);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0 || byte == kStop) {
+                return;
+            }
+            path tmp_file = dump_file_;
+            tmp_file += ".tmp";
+            {
+                ofstream out(tmp_file);
+                dump_(out);
+            }
+            error_code err;
+            filesystem::rename(tmp_file, dump_file_, err);
+            ++dumps_;
+        }
+    }
+
+    static inline volatile sig_atomic_t signal_fd_ = -1;
+
+    path dump_file_;
+    function<void(ostream&)> dump_;
+    int pipe_[2] = {-1, -1};
+    struct sigaction previous_ {};
+    thread thread_;
+    atomic<size_t> dumps_ = 0;
+};
+#endif
+
+#ifdef __linux__
+/**
+ * Результаты препроцессинга в запечатанных memfd
+ * Дескриптор результата можно передать другому процессу через SCM_RIGHTS
+ * (см. SendFd), и тот отобразит результат в память без копирования.
+ * Запечатанный memfd неизменяем, поэтому для входного файла, ни один из
+ * прочитанных файлов которого не менялся и в директориях поиска которого
+ * не появилось перекрывающих файлов, повторно отдаётся тот же memfd
+ *
+ * Get можно вызывать из нескольких потоков
+ */
+class MemfdOutputs {
+public:
+    MemfdOutputs() = default;
+    MemfdOutputs(const MemfdOutputs&) = delete;
+    MemfdOutputs& operator=(const MemfdOutputs&) = delete;
+
+    ~MemfdOutputs() {
+        for (auto& [key, entry] : entries_) {
+            close(entry.fd);
+        }
+    }
+
+    /**
+     * Возвращает memfd с результатом препроцессинга входного файла
+     * Дескриптор открыт только для чтения со своей позицией, стоящей в начале
+     *
+     * @param input_file - путь к входному файлу
+     * @param include_dirs - список директорий для поиска заголовочных файлов
+     * @param options - параметры препроцессинга; результат частями и индекс
+     *                  строк в memfd не пишутся, такие параметры - ошибка
+     * @return новый дескриптор, которым владеет вызывающий, или -1 при ошибке
+     */
+    int Get(const path& input_file, const vector<path>& include_dirs, const PreprocessOptions& options = {}) {
+        if (options.chunk_size != 0 || options.line_index_interval != 0) {
+            cout << "Ошибка: результат в memfd не делится на части и не индексируется" << endl;
+            return -1;
+        }
+        string key = GetOptionsKey(options) + '\n' + input_file.string();
+        for (const auto& dir : include_dirs) {
+            key += '\n' + dir.string();
+        }
+
+        {
+            // Дескриптор закрывается только под блокировкой, поэтому открывается под ней же
+            lock_guard lock(mutex_);
+            auto it = entries_.find(key);
+            if (it != entries_.end() && IsUnchanged(it->second)) {
+                return OpenReader(it->second.fd);
+            }
+        }
+
+        if (!filesystem::exists(input_file)) {
+            cout << "Ошибка: Не удалось открыть входной файл: " << input_file.string() << endl;
+            return -1;
+        }
+        int fd = memfd_create(input_file.filename().c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0) {
+            return -1;
+        }
+
+        // Директория, изменённая незадолго до начала обработки, могла измениться
+        // и во время неё, не поменяв время изменения; ей отметка не ставится
+        const int64_t trusted_before = GetNowStamp() - kStampGranularity;
+        vector<StampedFile> read_files;
+        bool success;
+        {
+            OutputSink output(fd);
+            success = PreprocessToSink(input_file, output, include_dirs, options, &read_files);
+        }
+        if (!success || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+            close(fd);
+            return -1;
+        }
+
+        // Отметки файлов - версии, которые были прочитаны, а не текущие
+        Entry entry{fd, StampSearchDirs(read_files, include_dirs, trusted_before), move(read_files)};
+
+        // Тот же файл мог одновременно обработать другой поток; остаётся последний результат
+        lock_guard lock(mutex_);
+        const int result = OpenReader(fd);
+        auto [it, inserted] = entries_.try_emplace(move(key), move(entry));
+        if (!inserted) {
+            close(it->second.fd);
+            it->second = move(entry);
+        }
+        return result;
+    }
+
+private:
+    static constexpr int64_t kStampGranularity = 1000000000; // запас на грубое время ФС, нс
+    static constexpr int64_t kUntrusted = -2;                 // отметка, не совпадающая ни с одной
+
+    struct DirStamp {
+        path dir;
+        int64_t mtime;
+    };
+
+    struct Entry {
+        int fd;
+        vector<DirStamp> dirs;     // директории, где новый файл перекрыл бы прочитанный
+        vector<StampedFile> files; // все файлы, прочитанные при обработке
+    };
+
+    /**
+     * Параметры, от которых зависит результат (или которые могли бы на него
+     * повлиять): результаты с разными параметрами хранятся раздельно
+     */
+    static string GetOptionsKey(const PreprocessOptions& options) {
+        ostringstream key;
+        key << options.normalize_text << ' ' << options.io_policy.mmap_threshold << ' '
+            << options.io_policy.direct_threshold << ' ' << static_cast<const void*>(options.cache) << ' '
+            << (options.include_filter ? options.include_filter->GetKey() : "-"s);
+        return key.str();
+    }
+
+    // Текущее время в единицах GetMtime
+    static int64_t GetNowStamp() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Открывает memfd заново: у нового дескриптора своя позиция, и чтение
+    // одним получателем не сдвигает её другим. Без /proc - копия дескриптора,
+    // позиция общая, и читать его нужно через pread или mmap
+    static int OpenReader(int fd) {
+        int reader = open(("/proc/self/fd/"s + to_string(fd)).c_str(), O_RDONLY | O_CLOEXEC);
+        return reader >= 0 ? reader : fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    }
+
+    /**
+     * Времена изменения директорий, в которых новый файл мог бы перекрыть
+     * прочитанный. Для файла, найденного в директории include по пути
+     * sub/x.h, это sub во всех директориях include и в директориях
+     * прочитанных файлов (откуда ищутся "x.h"). Несуществующая поддиректория
+     * заменяется ближайшей существующей родительской: её создание меняет
+     * время изменения родительской
+     */
+    static vector<DirStamp> StampSearchDirs(const vector<StampedFile>& read_files, const vector<path>& include_dirs,
+                                            int64_t trusted_before) {
+        set<path> roots(include_dirs.begin(), include_dirs.end());
+        set<path> subdirs = {path()};
+        for (const auto& [file, stamp] : read_files) {
+            roots.insert(file.parent_path());
+            for (const auto& dir : include_dirs) {
+                path relative = file.lexically_relative(dir);
+                if (!relative.empty() && *relative.begin() != "..") {
+                    subdirs.insert(relative.parent_path());
+                }
+            }
+        }
+
+        set<path> dirs;
+        for (const auto& root : roots) {
+            for (const auto& subdir : subdirs) {
+                path dir = subdir.empty() ? root : root / subdir;
+                error_code err;
+                while (dir != root && !filesystem::is_directory(dir, err)) {
+                    dir = dir.parent_path();
+                }
+                dirs.insert(dir);
+            }
+        }
+        vector<DirStamp> stamps;
+        for (const auto& dir : dirs) {
+            const int64_t mtime = GetMtime(dir);
+            stamps.push_back({dir, mtime >= trusted_before ? kUntrusted : mtime});
+        }
+        return stamps;
+    }
+
+    // Результат зависит только от содержимого прочитанных файлов и от того,
+    // какие файлы находятся поиском; второе проверяется по директориям поиска
+    static bool IsUnchanged(const Entry& entry) {
+        for (const auto& [file, stamp] : entry.files) {
+            if (GetFileStamp(file) != stamp) {
+                return false;
+            }
+        }
+        for (const auto& stamp : entry.dirs) {
+            if (GetMtime(stamp.dir) != stamp.mtime) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    mutex mutex_;
+    unordered_map<string, Entry> entries_;
+};
+
+/**
+ * Передаёт дескриптор через Unix-сокет (SCM_RIGHTS)
+ *
+ * @param socket - сокет домена AF_UNIX
+ * @param fd - передаваемый дескриптор
+ * @return true в случае успеха
+ */
+bool SendFd(int socket, int fd) {
+    char byte = 0;
+    iovec iov{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(socket, &msg, MSG_NOSIGNAL) == 1;
+}
+
+/**
+ * Принимает дескриптор, переданный через SendFd
+ *
+ * @return полученный дескриптор или -1 при ошибке
+ */
+int ReceiveFd(int socket) {
+    char byte;
+    iovec iov{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
+    }
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+#endif
+
+/**
+ * Вспомогательная функция для чтения всего содержимого файла в строку
+ * 
+ * @param file - путь к файлу
+ * @return содержимое файла в виде строки
+ */
+string GetFileContents(const string& file) {
+    ifstream stream(file);
+    return {istreambuf_iterator<char>(stream), istreambuf_iterator<char>()};
+}
+
+/**
+ * Функция тестирования препроцессора
+ * Создаёт тестовую файловую структуру и проверяет корректность работы
+ */
+void Test() {
+    error_code err;
+    
+    // Очистка и создание тестовой структуры директорий
+    filesystem::remove_all("sources"_p, err);
+    filesystem::create_directories("sources"_p / "include2"_p / "lib"_p, err);
+    filesystem::create_directories("sources"_p / "include1"_p, err);
+    filesystem::create_directories("sources"_p / "dir1"_p / "subdir"_p, err);
+
+    // Создание тестового основного файла sources/a.cpp
+    {
+        ofstream file("sources/a.cpp");
+        file << "// this comment before include\n"
+                "#include \"dir1/b.h\"\n"
+                "// text between b.h and c.h\n"
+                "#include \"dir1/d.h\"\n"
+                "\n"
+                "int SayHello() {\n"
+                "    cout << \"hello, world!\" << endl;\n"
+                "#   include<dummy.txt>\n" // Этот include должен вызвать ошибку
+                "}\n"s;
+    }
+    
+    // Создание тестового заголовка sources/dir1/b.h
+    {
+        ofstream file("sources/dir1/b.h");
+        file << "// text from b.h before include\n"
+                "#include \"subdir/c.h\"\n"
+                "// text from b.h after include"s;
+    }
+    
+    // Создание тестового заголовка sources/dir1/subdir/c.h
+    {
+        ofstream file("sources/dir1/subdir/c.h");
+        file << "// text from c.h before include\n"
+                "#include <std1.h>\n"
+                "// text from c.h after include\n"s;
+    }
+    
+    // Создание тестового заголовка sources/dir1/d.h
+    {
+        ofstream file("sources/dir1/d.h");
+        file << "// text from d.h before include\n"
+                "#include \"lib/std2.h\"\n"
+                "// text from d.h after include\n"s;
+    }
+    
+    // Создание системного заголовка sources/include1/std1.h
+    {
+        ofstream file("sources/include1/std1.h");
+        file << "// std1\n"s;
+    }
+    
+    // Создание системного заголовка sources/include2/lib/std2.h
+    {
+        ofstream file("sources/include2/lib/std2.h");
+        file << "// std2\n"s;
+    }
+
+    // Запуск препроцессинга (ожидается неудача из-за dummy.txt)
+    assert(!Preprocess("sources"_p / "a.cpp"_p, "sources"_p / "a.in"_p,
+                       {"sources"_p / "include1"_p, "sources"_p / "include2"_p}));
+
+    // Ожидаемый результат после успешного препроцессинга
+    ostringstream test_out;
+    test_out << "// this comment before include\n"
+                "// text from b.h before include\n"
+                "// text from c.h before include\n"
+                "// std1\n"
+                "// text from c.h after include\n"
+                "// text from b.h after include\n"
+                "// text between b.h and c.h\n"
+                "// text from d.h before include\n"
+                "// std2\n"
+                "// text from d.h after include\n"
+                "\n"
+                "int SayHello() {\n"
+                "    cout << \"hello, world!\" << endl;\n"s;
+
+    // Проверка корректности результата
+    assert(GetFileContents("sources/a.in"s) == test_out.str());
+}
+
+/**
+ * Тестирование снимка тёплого состояния
+ * Проверяет, что загруженный снимок даёт тот же результат, а изменения
+ * файлов и директорий после сохранения снимка делают его записи устаревшими
+ */
+void TestWarmSnapshot() {
+    error_code err;
+    filesystem::remove_all("snapshot"_p, err);
+    filesystem::create_directories("snapshot"_p / "inc1"_p, err);
+    filesystem::create_directories("snapshot"_p / "inc2"_p, err);
+
+    {
+        // Последняя строка без перевода строки: по сводке он добавляется так же,
+        // как при просмотре строк
+        ofstream file("snapshot/main.cpp");
+        file << "#include <lib.h>\n"
+                "#include \"local.h\"\n"
+                "int x;\n"
+                "int main() {}"s;
+    }
+    {
+        ofstream file("snapshot/local.h");
+        file << "// local\n"s;
+    }
+    {
+        ofstream file("snapshot/inc2/lib.h");
+        file << "// lib from inc2\n"s;
+    }
+
+    const vector<path> include_dirs = {"snapshot"_p / "inc1"_p, "snapshot"_p / "inc2"_p};
+    const path snapshot_file = "snapshot"_p / "state.bin"_p;
+
+    {
+        IncludeCache cache;
+        PreprocessOptions options;
+        options.cache = &cache;
+        assert(Preprocess("snapshot"_p / "main.cpp"_p, "snapshot"_p / "main.in"_p, include_dirs, options));
+        assert(cache.SaveSnapshot(snapshot_file));
+    }
+    assert(GetFileContents("snapshot/main.in"s) == "// lib from inc2\n// local\nint x;\nint main() {}\n"s);
+
+    // Повторный запуск с загруженным снимком даёт тот же результат
+    {
+        IncludeCache cache;
+        assert(cache.LoadSnapshot(snapshot_file));
+        PreprocessOptions options;
+        options.cache = &cache;
+        assert(Preprocess("snapshot"_p / "main.cpp"_p, "snapshot"_p / "main.in"_p, include_dirs, options));
+    }
+    assert(GetFileContents("snapshot/main.in"s) == "// lib from inc2\n// local\nint x;\nint main() {}\n"s);
+
+    // Новый файл в более приоритетной директории и изменённый заголовок
+    // должны быть замечены при работе со старым снимком
+    {
+        ofstream file("snapshot/inc1/lib.h");
+        file << "// lib from inc1\n"s;
+    }
+    {
+        ofstream file("snapshot/local.h");
+        file << "// local changed\n#include <lib.h>\n"s;
+    }
+    {
+        IncludeCache cache;
+        assert(cache.LoadSnapshot(snapshot_file));
+        PreprocessOptions options;
+        options.cache = &cache;
+        assert(Preprocess("snapshot"_p / "main.cpp"_p, "snapshot"_p / "main.in"_p, include_dirs, options));
+    }
+    assert(GetFileContents("snapshot/main.in"s)
+           == "// lib from inc1\n// local changed\n// lib from inc1\nint x;\nint main() {}\n"s);
+
+    // Заголовок, изменённый между двумя запусками на одном кэше,
+    // просматривается заново, а не разворачивается по старой сводке
+    {
+        IncludeCache cache;
+        PreprocessOptions options;
+        options.cache = &cache;
+        assert(Preprocess("snapshot"_p / "main.cpp"_p, "snapshot"_p / "main.in"_p, include_dirs, options));
+        {
+            ofstream file("snapshot/local.h");
+            file << "#include \"b.h\"\n// local edited after the first run\n"s;
+        }
+        {
+            ofstream file("snapshot/b.h");
+            file << "// b\n"s;
+        }
+        assert(Preprocess("snapshot"_p / "main.cpp"_p, "snapshot"_p / "main.in"_p, include_dirs, options));
+    }
+    assert(GetFileContents("snapshot/main.in"s)
+           == "// lib from inc1\n// b\n// local edited after the first run\nint x;\nint main() {}\n"s);
+
+    // Файл, переписанный во время просмотра тем же размером, не получает
+    // сводку, построенную по прочитанной версии: отметка берётся у неё
+    {
+        ofstream file("snapshot/edited.cpp");
+        file << "#include \"b.h\"\nint a;\n"s;
+    }
+    filesystem::last_write_time("snapshot"_p / "edited.cpp"_p, filesystem::file_time_type::clock::now() - 1h, err);
+    {
+        IncludeCache cache;
+        PreprocessOptions options;
+        options.cache = &cache;
+        bool edited = false;
+        options.at_include_boundary = [&edited]() {
+            if (!edited) {
+                edited = true;
+                ofstream file("snapshot/edited.cpp");
+                file << "int b;\n#include \"b.h\"\n"s;
+            }
+        };
+        assert(Preprocess("snapshot"_p / "edited.cpp"_p, "snapshot"_p / "edited.in"_p, {}, options));
+        assert(GetFileContents("snapshot/edited.in"s) == "// b\nint a;\n"s);
+        assert(Preprocess("snapshot"_p / "edited.cpp"_p, "snapshot"_p / "edited.in"_p, {}, options));
+    }
+    assert(GetFileContents("snapshot/edited.in"s) == "int b;\n// b\n"s);
+
+    // Повреждённый снимок не загружается
+    {
+        ofstream file(snapshot_file, ios::binary);
+        file << "PPSNAP04garbage"s;
+    }
+    IncludeCache cache;
+    assert(!cache.LoadSnapshot(snapshot_file));
+}
+
+/**
+ * Тестирование учёта счётчиков по фазам
+ * Аппаратные счётчики могут быть недоступны, поэтому проверяется только
+ * наличие записей и согласованность итога с данными по файлам
+ */
+void TestPhaseStats() {
+    error_code err;
+    filesystem::remove_all("stats"_p, err);
+    filesystem::create_directories("stats"_p, err);
+    {
+        ofstream file("stats/a.cpp");
+        file << "#include \"b.h\"\nint a;\n"s;
+    }
+    {
+        ofstream file("stats/b.h");
+        file << "int b;\n"s;
+    }
+
+    PreprocessStats stats;
+    PreprocessOptions options;
+    options.stats = &stats;
+    assert(Preprocess("stats"_p / "a.cpp"_p, "stats"_p / "a.in"_p, {}, options));
+    assert(Preprocess("stats"_p / "b.h"_p, "stats"_p / "b.in"_p, {}, options));
+    assert(GetFileContents("stats/a.in"s) == "int b;\nint a;\n"s);
+
+    assert(stats.units.size() == 2);
+    for (size_t i = 0; i < kPhaseCount; ++i) {
+        assert(stats.total[i].nanoseconds
+               == stats.units[0].phases[i].nanoseconds + stats.units[1].phases[i].nanoseconds);
+    }
+    if (stats.hw_counters) {
+        assert(stats.total[static_cast<size_t>(Phase::kScan)].instructions > 0);
+    }
+
+    // Число переключений фаз зависит от числа директив, а не строк
+    {
+        ofstream file("stats/long.cpp");
+        for (int i = 0; i < 1000; ++i) {
+            file << "int line_" << i << ";\n";
+            if (i % 500 == 0) {
+                file << "#include \"b.h\"\n";
+            }
+        }
+    }
+    PreprocessStats long_stats;
+    options.stats = &long_stats;
+    assert(Preprocess("stats"_p / "long.cpp"_p, "stats"_p / "long.in"_p, {}, options));
+    uint64_t intervals = 0;
+    for (const PhaseCounters& c : long_stats.total) {
+        intervals += c.intervals;
+    }
+    assert(intervals > 0 && intervals < 30);
+
+    // Запись заполненного буфера относится к kWrite, хотя строки без
+    // директив выводятся при просмотре: по интервалу на буфер и итоговая запись
+    {
+        ofstream file("stats/plain.cpp");
+        for (int i = 0; i < 10000; ++i) {
+            file << "int plain_line_" << i << ";\n";
+        }
+    }
+    PreprocessStats plain_stats;
+    options.stats = &plain_stats;
+    assert(Preprocess("stats"_p / "plain.cpp"_p, "stats"_p / "plain.in"_p, {}, options));
+    const size_t plain_size = static_cast<size_t>(filesystem::file_size("stats"_p / "plain.in"_p));
+    const PhaseCounters& plain_write = plain_stats.total[static_cast<size_t>(Phase::kWrite)];
+    assert(plain_size > 3 * 64 * 1024);
+    assert(plain_write.intervals == plain_size / (64 * 1024) + 1);
+
+    ostringstream report;
+    stats.Print(report);
+    assert(report.str().find("resolve") != string::npos);
+}
+
+/**
+ * Тестирование выбора способа чтения файлов
+ * Маленькие файлы читаются через read, большие отображаются в память или
+ * читаются с O_DIRECT, а результат от способа не зависит
+ */
+void TestIoPolicy() {
+    error_code err;
+    filesystem::remove_all("io"_p, err);
+    filesystem::create_directories("io"_p, err);
+    {
+        ofstream file("io/main.cpp");
+        file << "#include \"big.h\"\nint main() {}"s;
+    }
+    {
+        ofstream file("io/big.h");
+        for (int i = 0; i < 10000; ++i) {
+            file << "int big_" << i << ";\n";
+        }
+    }
+
+    PreprocessStats stats;
+    PreprocessOptions options;
+    options.stats = &stats;
+    options.io_policy.mmap_threshold = 4096;
+    assert(Preprocess("io"_p / "main.cpp"_p, "io"_p / "main.in"_p, {}, options));
+    assert(stats.reads[static_cast<size_t>(ReadMethod::kRead)] == 1);
+    assert(stats.reads[static_cast<size_t>(ReadMethod::kMmap)] == 1);
+    assert(stats.read_bytes[static_cast<size_t>(ReadMethod::kMmap)] == filesystem::file_size("io"_p / "big.h"_p));
+
+    // O_DIRECT поддерживают не все ФС; без него файл читается обычным read
+    for (ReadMethod method : {ReadMethod::kRead, ReadMethod::kMmap, ReadMethod::kDirect}) {
+        PreprocessOptions forced;
+        forced.io_policy = IoPolicy::Forced(method);
+        assert(Preprocess("io"_p / "main.cpp"_p, "io"_p / "forced.in"_p, {}, forced));
+        assert(GetFileContents("io/forced.in"s) == GetFileContents("io/main.in"s));
+    }
+
+    IoPolicy policy;
+    policy.mmap_threshold = 12345;
+    policy.direct_threshold = 678910;
+    assert(policy.Save("io"_p / "policy.txt"_p));
+    optional<IoPolicy> loaded = IoPolicy::Load("io"_p / "policy.txt"_p);
+    assert(loaded && loaded->mmap_threshold == 12345 && loaded->direct_threshold == 678910);
+    assert(!IoPolicy::Load("io"_p / "missing.txt"_p));
+
+    // Загруженная калибровка становится политикой новых параметров препроцессинга
+    assert(LoadIoCalibration("io"_p / "missing.txt"_p, false));
+    assert(!LoadIoCalibration("io"_p / "missing.txt"_p, true));
+    assert(LoadIoCalibration("io"_p / "policy.txt"_p, true));
+    assert(PreprocessOptions().io_policy.mmap_threshold == 12345);
+    assert(PreprocessOptions().io_policy.direct_threshold == 678910);
+    IoPolicy::SetDefault({});
+    assert(PreprocessOptions().io_policy.mmap_threshold == IoPolicy().mmap_threshold);
+}
+
+/**
+ * Тестирование выборочного разворачивания
+ * Директивы, подошедшие под фильтр по виду, шаблону имени или директории,
+ * выводятся как есть, остальные разворачиваются
+ */
+void TestIncludeFilter() {
+    error_code err;
+    filesystem::remove_all("filter"_p, err);
+    for (const char* dir : {"sys/bits", "project/gen", "vendor"}) {
+        filesystem::create_directories("filter"_p / dir, err);
+    }
+    {
+        ofstream file("filter/main.cpp");
+        file << "#include <vector>\n"
+                "#include \"local.h\"\n"
+                "#  include <gen/table.inc>\n"
+                "#include <lib.h>\n"
+                "int main() {}\n"s;
+    }
+    for (const char* header : {"filter/local.h", "filter/sys/vector", "filter/sys/bits/impl.h",
+                               "filter/project/gen/table.inc", "filter/vendor/lib.h"}) {
+        ofstream file(header);
+        file << "// "s << header << '\n';
+    }
+    {
+        ofstream file("filter/sys/vector", ios::app);
+        file << "#include <bits/impl.h>\n"s;
+    }
+
+    const vector<path> include_dirs = {"filter"_p / "sys"_p, "filter"_p / "project"_p, "filter"_p / "vendor"_p};
+    IncludeFilter filter;
+    filter.AddGlob("gen/**.inc");
+    filter.AddDir("filter"_p / "vendor"_p);
+    IncludeCache cache;
+    PreprocessOptions options;
+    options.include_filter = &filter;
+    options.cache = &cache;
+    const string expected = "// filter/sys/vector\n// filter/sys/bits/impl.h\n// filter/local.h\n"
+                            "#  include <gen/table.inc>\n#include <lib.h>\nint main() {}\n"s;
+    // Второй проход идёт по сводкам директив из кэша
+    for (int pass = 0; pass < 2; ++pass) {
+        assert(Preprocess("filter"_p / "main.cpp"_p, "filter"_p / "main.in"_p, include_dirs, options));
+        assert(GetFileContents("filter/main.in"s) == expected);
+    }
+
+    // Все системные заголовки <...> остаются директивами
+    IncludeFilter angle;
+    angle.keep_angle = true;
+    options.include_filter = &angle;
+    assert(Preprocess("filter"_p / "main.cpp"_p, "filter"_p / "angle.in"_p, include_dirs, options));
+    assert(GetFileContents("filter/angle.in"s)
+           == "#include <vector>\n// filter/local.h\n#  include <gen/table.inc>\n#include <lib.h>\nint main() {}\n"s);
+
+    IncludeFilter globs;
+    for (const char* pattern : {"a/*.h", "b/**", "c?.h", "*/x/**/y.h", "exact.h"}) {
+        globs.AddGlob(pattern);
+    }
+    auto keeps = [&globs](const string& name) {
+        return globs.Keeps({0, false, name});
+    };
+    assert(keeps("a/x.h") && !keeps("a/b/x.h") && !keeps("a/x.hpp"));
+    assert(keeps("b/") && keeps("b/c/d.h") && !keeps("bb/c.h"));
+    assert(keeps("c1.h") && !keeps("c/.h") && !keeps("c12.h"));
+    assert(keeps("p/x/y.h") && keeps("p/x/q/r/y.h") && !keeps("p/q/x/y.h"));
+    assert(keeps("exact.h") && !keeps("exact.hh"));
+}
+
+/**
+ * Тестирование нормализации текста
+ * CRLF заменяется на LF, BOM UTF-8 убирается в начале каждого файла, в том
+ * числе при разворачивании по сводкам из кэша; без нормализации текст не
+ * меняется, но директива сразу после BOM всё равно находится
+ */
+void TestNormalize() {
+    error_code err;
+    filesystem::remove_all("normalize"_p, err);
+    filesystem::create_directories("normalize"_p, err);
+    {
+        ofstream file("normalize/main.cpp", ios::binary);
+        file << "\xEF\xBB\xBF#include \"a.h\"\r\nint main() {\r\n  return 0;\r\n}\r\nint lone = '\r';\r\n"
+                "#include \"b.h\"\r\nint last;\r"s;
+    }
+    {
+        ofstream file("normalize/a.h", ios::binary);
+        file << "\xEF\xBB\xBF// a\r\n"s;
+    }
+    {
+        ofstream file("normalize/b.h", ios::binary);
+        file << "// b\n"s;
+    }
+
+    IncludeCache cache;
+    PreprocessOptions options;
+    options.cache = &cache;
+    options.normalize_text = true;
+    for (int pass = 0; pass < 2; ++pass) {
+        assert(Preprocess("normalize"_p / "main.cpp"_p, "normalize"_p / "main.in"_p, {}, options));
+        assert(GetFileContents("normalize/main.in"s)
+               == "// a\nint main() {\n  return 0;\n}\nint lone = '\r';\n// b\nint last;\n"s);
+    }
+
+    options.normalize_text = false;
+    assert(Preprocess("normalize"_p / "main.cpp"_p, "normalize"_p / "raw.in"_p, {}, options));
+    assert(GetFileContents("normalize/raw.in"s)
+           == "\xEF\xBB\xBF\xEF\xBB\xBF// a\r\nint main() {\r\n  return 0;\r\n}\r\nint lone = '\r';\r\n// b\nint last;\r\n"s);
+
+    // Длинный текст проверяет векторный поиск '\r' на границах блоков по 16 байт;
+    // второй проход копирует файл по сводке целыми участками
+    string text;
+    string expected;
+    for (int i = 0; i < 100; ++i) {
+        string line(static_cast<size_t>(i % 37), 'x');
+        text += line + (i % 3 ? "\r\n" : "\n");
+        expected += line + "\n";
+    }
+    {
+        ofstream file("normalize/long.h", ios::binary);
+        file << text;
+    }
+    options.normalize_text = true;
+    for (int pass = 0; pass < 2; ++pass) {
+        assert(Preprocess("normalize"_p / "long.h"_p, "normalize"_p / "long.in"_p, {}, options));
+        assert(GetFileContents("normalize/long.in"s) == expected);
+    }
+}
+
+/**
+ * Тестирование перекодировки исходников UTF-16 в UTF-8
+ */
+void TestUtf16() {
+    error_code err;
+    filesystem::remove_all("utf16"_p, err);
+    filesystem::create_directories("utf16"_p, err);
+    auto write_utf16 = [](const path& file_path, u16string_view text, bool big_endian, string tail = {}) {
+        string bytes;
+        for (char16_t unit : text) {
+            char low = static_cast<char>(unit & 0xFF);
+            char high = static_cast<char>(unit >> 8);
+            bytes += big_endian ? string{high, low} : string{low, high};
+        }
+        ofstream file(file_path, ios::binary);
+        file << bytes << tail;
+    };
+
+    // Длинная строка ASCII проходит векторный путь, кириллица и эмодзи — скалярный
+    const string ascii_run(40, 'a');
+    const u16string ascii_run16(ascii_run.begin(), ascii_run.end());
+    write_utf16("utf16/main.cpp"_p,
+                u"\uFEFF#include \"le.h\"\n// "s + ascii_run16 + u" привет \U0001F600 " + ascii_run16 + u"\n#include \"be.h\"\n",
+                false);
+    write_utf16("utf16/le.h"_p, u"\uFEFFint le = 1; // é\n", false);
+    write_utf16("utf16/be.h"_p, u"\uFEFFint be = 2; // 中\n", true);
+    // Непарный суррогат и нечётный последний байт
+    write_utf16("utf16/broken.h"_p, u"\uFEFFx\xD800y\n", false, "z"s);
+
+    const string expected = "\xEF\xBB\xBF\xEF\xBB\xBFint le = 1; // \xC3\xA9\n// " + ascii_run
+                            + " \xD0\xBF\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82 \xF0\x9F\x98\x80 " + ascii_run
+                            + "\n\xEF\xBB\xBFint be = 2; // \xE4\xB8\xAD\n";
+    IncludeCache cache;
+    PreprocessOptions options;
+    options.cache = &cache;
+    for (int pass = 0; pass < 2; ++pass) {
+        assert(Preprocess("utf16"_p / "main.cpp"_p, "utf16"_p / "main.in"_p, {}, options));
+        assert(GetFileContents("utf16/main.in"s) == expected);
+    }
+
+    options.normalize_text = true;
+    assert(Preprocess("utf16"_p / "main.cpp"_p, "utf16"_p / "norm.in"_p, {}, options));
+    string normalized = expected;
+    for (size_t pos; (pos = normalized.find(kUtf8Bom)) != string::npos;) {
+        normalized.erase(pos, kUtf8Bom.size());
+    }
+    assert(GetFileContents("utf16/norm.in"s) == normalized);
+
+    assert(Preprocess("utf16"_p / "broken.h"_p, "utf16"_p / "broken.in"_p, {}, options));
+    assert(GetFileContents("utf16/broken.in"s) == "x\xEF\xBF\xBDy\n\xEF\xBF\xBD\n"s);
+
+    // Блоки только из двухбайтовых символов и вперемешку с ASCII
+    u16string mixed16 = u"\uFEFF"s;
+    string mixed = "\xEF\xBB\xBF"s;
+    for (int i = 0; i < 40; ++i) {
+        mixed16 += i % 3 == 0 ? u"ж ж" : u"ж";
+        mixed += i % 3 == 0 ? "\xD0\xB6 \xD0\xB6" : "\xD0\xB6";
+    }
+    write_utf16("utf16/cyr.h"_p, mixed16 + u"\n", false);
+    assert(Preprocess("utf16"_p / "cyr.h"_p, "utf16"_p / "cyr.in"_p, {}));
+    assert(GetFileContents("utf16/cyr.in"s) == mixed + "\n");
+
+    // Смещения сводки перекодированного файла больше размера файла в UTF-16,
+    // но снимок с ней всё равно загружается
+    write_utf16("utf16/cjk.cpp"_p, u"\uFEFF"s + u16string(100, u'中') + u"\n#include \"le.h\"\n", false);
+    assert(Preprocess("utf16"_p / "cjk.cpp"_p, "utf16"_p / "cjk.in"_p, {}, options));
+    assert(cache.SaveSnapshot("utf16"_p / "state.bin"_p));
+    IncludeCache loaded;
+    assert(loaded.LoadSnapshot("utf16"_p / "state.bin"_p));
+
+    // Суррогатная пара на границе частей перекодировки
+    write_utf16("utf16/boundary.h"_p, u"\uFEFF"s + u16string(16382, u'a') + u"\U0001F600\n", true);
+    assert(Preprocess("utf16"_p / "boundary.h"_p, "utf16"_p / "boundary.in"_p, {}, options));
+    assert(GetFileContents("utf16/boundary.in"s) == string(16382, 'a') + "\xF0\x9F\x98\x80\n");
+}
+
+/**
+ * Тестирование индекса строк результата
+ * Каждая строка результата читается по индексу и сравнивается с построчным
+ * чтением; последняя строка без перевода строки тоже учитывается
+ */
+void TestLineIndex() {
+    error_code err;
+    filesystem::remove_all("line_index"_p, err);
+    filesystem::create_directories("line_index"_p, err);
+    {
+        ofstream file("line_index/main.cpp");
+        file << "// main\n#include \"a.h\"\n\nint main() {}\n#include \"a.h\"\nint last;"s;
+    }
+    {
+        ofstream file("line_index/a.h");
+        for (int i = 0; i < 10; ++i) {
+            file << "int a" << i << ";\n";
+        }
+    }
+
+    PreprocessOptions options;
+    options.line_index_interval = 3;
+    assert(Preprocess("line_index"_p / "main.cpp"_p, "line_index"_p / "main.in"_p, {}, options));
+    vector<string> lines;
+    {
+        ifstream input("line_index/main.in");
+        for (string line; getline(input, line);) {
+            lines.push_back(line);
+        }
+    }
+    assert(lines.size() == 24);
+
+    optional<LineIndex> index = LineIndex::LoadFrom(GetLineIndexPath("line_index"_p / "main.in"_p));
+    assert(index && index->GetInterval() == 3 && index->GetLineCount() == lines.size());
+    for (size_t i = 0; i < lines.size(); ++i) {
+        assert(index->Find(i)->skip_lines < 3);
+        assert(ReadOutputLine("line_index"_p / "main.in"_p, *index, i) == lines[i]);
+    }
+    assert(!index->Find(lines.size()));
+    assert(!ReadOutputLine("line_index"_p / "main.in"_p, *index, lines.size()));
+
+    // Результат, заканчивающийся переводом строки, не имеет пустой последней строки
+    assert(Preprocess("line_index"_p / "a.h"_p, "line_index"_p / "a.in"_p, {}, options));
+    index = LineIndex::LoadFrom(GetLineIndexPath("line_index"_p / "a.in"_p));
+    assert(index && index->GetLineCount() == 10);
+    assert(ReadOutputLine("line_index"_p / "a.in"_p, *index, 9) == "int a9;"s);
+
+    {
+        ofstream file("line_index/broken.lines");
+        file << "garbage"s;
+    }
+    assert(!LineIndex::LoadFrom("line_index"_p / "broken.lines"_p));
+    assert(!LineIndex::LoadFrom("line_index"_p / "missing.lines"_p));
+
+    // Одинаковые задания движка: присоединившееся получает и свой индекс
+    {
+        PreprocessEngine engine(1, 0, options);
+        future<bool> first = engine.Submit({"line_index"_p / "main.cpp"_p, "line_index"_p / "first.in"_p, {}});
+        future<bool> second = engine.Submit({"line_index"_p / "main.cpp"_p, "line_index"_p / "second.in"_p, {}});
+        assert(first.get() && second.get());
+    }
+    index = LineIndex::LoadFrom(GetLineIndexPath("line_index"_p / "second.in"_p));
+    assert(index && index->GetLineCount() == lines.size());
+    for (size_t i = 0; i < lines.size(); ++i) {
+        assert(ReadOutputLine("line_index"_p / "second.in"_p, *index, i) == lines[i]);
+    }
+}
+
+/**
+ * Тестирование вывода результата частями
+ * Части вместе дают тот же результат, что и один файл, разрываются только
+ * на границах строк, а манифест описывает их по порядку вместе с файлами,
+ * из которых в них попал текст
+ */
+void TestChunkedOutput() {
+    error_code err;
+    filesystem::remove_all("chunks"_p, err);
+    filesystem::create_directories("chunks"_p, err);
+    {
+        ofstream file("chunks/main.cpp");
+        file << "// main\n#include \"a.h\"\nint middle;\n#include \"b.h\"\nint last;"s;
+    }
+    for (const char* name : {"a", "b"}) {
+        ofstream file("chunks/"s + name + ".h");
+        for (int i = 0; i < 20; ++i) {
+            file << "int " << name << i << " = " << i << ";\n";
+        }
+    }
+    assert(Preprocess("chunks"_p / "main.cpp"_p, "chunks"_p / "whole.in"_p, {}));
+    const string whole = GetFileContents("chunks/whole.in"s);
+
+    IncludeCache cache;
+    PreprocessOptions options;
+    options.cache = &cache;
+    options.chunk_size = 100;
+    for (int pass = 0; pass < 2; ++pass) {
+        assert(Preprocess("chunks"_p / "main.cpp"_p, "chunks"_p / "main.in"_p, {}, options));
+        assert(!filesystem::exists("chunks/main.in"_p));
+
+        ifstream manifest(OutputChunks::GetManifestPath("chunks"_p / "main.in"_p));
+        string word;
+        size_t count = 0;
+        manifest >> word >> count;
+        assert(word == "chunks" && count > 3);
+        string joined;
+        vector<vector<string>> sources(count);
+        size_t chunk_index = 0;
+        for (string line; getline(manifest >> ws, line);) {
+            istringstream fields(line);
+            fields >> word;
+            if (word == "source") {
+                sources[chunk_index - 1].push_back(line.substr(word.size() + 1));
+                continue;
+            }
+            string name;
+            uint64_t bytes = 0;
+            uint64_t lines = 0;
+            fields >> name >> bytes >> lines;
+            assert(word == "chunk" && name == "main.in." + to_string(chunk_index));
+            const string text = GetFileContents("chunks/"s + name);
+            assert(text.size() == bytes);
+            assert(static_cast<uint64_t>(count_if(text.begin(), text.end(), [](char c) { return c == '\n'; })) == lines);
+            if (chunk_index + 1 < count) {
+                // Последняя строка части начинается до заданного размера
+                assert(bytes >= 100 && text.back() == '\n' && text.rfind('\n', bytes - 2) + 1 < 100);
+            }
+            joined += text;
+            ++chunk_index;
+        }
+        assert(chunk_index == count);
+        assert(joined == whole);
+        assert(sources.front() == (vector<string>{"chunks/main.cpp", "chunks/a.h"}));
+        assert(sources.back().back() == "chunks/main.cpp");
+        for (const auto& chunk_sources : sources) {
+            assert(!chunk_sources.empty());
+        }
+    }
+
+    // Одинаковые задания движка: присоединившееся получает свои копии частей
+    {
+        PreprocessEngine engine(1, 0, options);
+        future<bool> first = engine.Submit({"chunks"_p / "main.cpp"_p, "chunks"_p / "first.in"_p, {}});
+        future<bool> second = engine.Submit({"chunks"_p / "main.cpp"_p, "chunks"_p / "second.in"_p, {}});
+        assert(first.get() && second.get());
+    }
+    const string first_manifest = GetFileContents(OutputChunks::GetManifestPath("chunks"_p / "first.in"_p).string());
+    string second_manifest = GetFileContents(OutputChunks::GetManifestPath("chunks"_p / "second.in"_p).string());
+    for (size_t pos; (pos = second_manifest.find("second.in")) != string::npos;) {
+        second_manifest.replace(pos, 9, "first.in");
+    }
+    assert(second_manifest == first_manifest);
+    string second_joined;
+    for (size_t i = 0; filesystem::exists(OutputChunks::GetChunkPath("chunks"_p / "second.in"_p, i)); ++i) {
+        second_joined += GetFileContents(OutputChunks::GetChunkPath("chunks"_p / "second.in"_p, i).string());
+    }
+    assert(second_joined == whole);
+
+    // Части прошлого запуска, которых нет в новом манифесте, удаляются
+    options.chunk_size = 1024 * 1024;
+    assert(Preprocess("chunks"_p / "main.cpp"_p, "chunks"_p / "main.in"_p, {}, options));
+    assert(GetFileContents("chunks/main.in.0"s) == whole);
+    assert(!filesystem::exists("chunks/main.in.1"_p));
+}
+
+/**
+ * Тестирование статистики использования директорий include
+ * и одновременной проверки директорий
+ */
+void TestDirUsage() {
+    error_code err;
+    filesystem::remove_all("dir_usage"_p, err);
+    for (const char* dir : {"inc1", "inc2", "inc3"}) {
+        filesystem::create_directories("dir_usage"_p / dir, err);
+    }
+    {
+        ofstream file("dir_usage/main.cpp");
+        file << "#include <x.h>\n#include <y.h>\n"s;
+    }
+    for (const char* header : {"dir_usage/inc1/x.h", "dir_usage/inc2/x.h", "dir_usage/inc2/y.h"}) {
+        ofstream file(header);
+        file << "// "s << header << '\n';
+    }
+
+    const vector<path> include_dirs = {"dir_usage"_p / "inc1"_p, "dir_usage"_p / "inc2"_p, "dir_usage"_p / "inc3"_p};
+    PreprocessStats stats;
+    PreprocessOptions options;
+    options.stats = &stats;
+    options.detect_shadowing = true;
+    assert(Preprocess("dir_usage"_p / "main.cpp"_p, "dir_usage"_p / "main.in"_p, include_dirs, options));
+
+    assert(stats.dirs.size() == 3);
+    assert(stats.dirs[0].probes == 2 && stats.dirs[0].hits == 1 && stats.dirs[0].shadowed == 0);
+    assert(stats.dirs[1].probes == 1 && stats.dirs[1].hits == 1 && stats.dirs[1].shadowed == 1);
+    assert(stats.dirs[2].probes == 0 && stats.dirs[2].hits == 0);
+    assert(stats.probes == 3);
+
+    ostringstream report;
+    stats.Print(report);
+    assert(report.str().find("inc3 probes=0 hits=0 shadowed=0 unused") != string::npos);
+    // Одновременная проверка директорий даёт тот же результат и ту же статистику
+    ProbePool pool(4);
+    PreprocessStats pool_stats;
+    options.stats = &pool_stats;
+    options.probe_pool = &pool;
+    assert(Preprocess("dir_usage"_p / "main.cpp"_p, "dir_usage"_p / "pool.in"_p, include_dirs, options));
+    assert(GetFileContents("dir_usage/pool.in"s) == GetFileContents("dir_usage/main.in"s));
+    for (size_t i = 0; i < stats.dirs.size(); ++i) {
+        assert(pool_stats.dirs[i].probes == stats.dirs[i].probes && pool_stats.dirs[i].hits == stats.dirs[i].hits);
+    }
+
+    // Пул без потоков проверяет кандидатов сам
+    ProbePool inline_pool(0);
+    options.probe_pool = &inline_pool;
+    assert(Preprocess("dir_usage"_p / "main.cpp"_p, "dir_usage"_p / "inline.in"_p, include_dirs, options));
+    assert(GetFileContents("dir_usage/inline.in"s) == GetFileContents("dir_usage/main.in"s));
+}
+
+/**
+ * Тестирование фильтров Блума директорий include
+ * Директории, где заголовка точно нет, не проверяются; новый заголовок
+ * находится без ручного сброса сохранённых фильтров
+ */
+void TestBloom() {
+    error_code err;
+    filesystem::remove_all("bloom"_p, err);
+    for (const char* dir : {"inc1/sub", "inc2", "inc3"}) {
+        filesystem::create_directories("bloom"_p / dir, err);
+    }
+    {
+        ofstream file("bloom/main.cpp");
+        file << "#include <x.h>\n#include <sub/y.h>\n"s;
+    }
+    for (const char* header : {"bloom/inc1/sub/y.h", "bloom/inc3/x.h"}) {
+        ofstream file(header);
+        file << "// "s << header << '\n';
+    }
+    // Времена изменения директорий сдвигаются в прошлое, чтобы новый файл
+    // заведомо менял их и при грубом разрешении времени файловой системы
+    const auto past = filesystem::file_time_type::clock::now() - 1h;
+    for (const char* dir : {"inc1", "inc1/sub", "inc2", "inc3"}) {
+        filesystem::last_write_time("bloom"_p / dir, past, err);
+    }
+
+    const vector<path> include_dirs = {"bloom"_p / "inc1"_p, "bloom"_p / "inc2"_p, "bloom"_p / "inc3"_p};
+    assert(Preprocess("bloom"_p / "main.cpp"_p, "bloom"_p / "plain.in"_p, include_dirs));
+
+    PreprocessStats stats;
+    PreprocessOptions options;
+    options.stats = &stats;
+    {
+        BloomIndex index("bloom"_p / "filters"_p);
+        options.bloom_index = &index;
+        assert(Preprocess("bloom"_p / "main.cpp"_p, "bloom"_p / "main.in"_p, include_dirs, options));
+        assert(index.GetRebuildCount() == 3);
+    }
+    assert(GetFileContents("bloom/main.in"s) == GetFileContents("bloom/plain.in"s));
+    assert(stats.probes == 2);
+    assert(stats.dirs[0].probes == 1 && stats.dirs[1].probes == 0 && stats.dirs[2].probes == 1);
+
+    // Сохранённые фильтры загружаются без перестроения, а новый заголовок
+    // в поддиректории помечает устаревшим только фильтр своей директории
+    {
+        ofstream file("bloom/inc1/sub/x.h");
+        file << "// shadow\n"s;
+    }
+    {
+        ofstream file("bloom/main.cpp");
+        file << "#include <sub/x.h>\n#include <x.h>\n"s;
+    }
+    BloomIndex index("bloom"_p / "filters"_p);
+    options.bloom_index = &index;
+    assert(Preprocess("bloom"_p / "main.cpp"_p, "bloom"_p / "main.in"_p, include_dirs, options));
+    assert(index.GetRebuildCount() == 1);
+    assert(GetFileContents("bloom/main.in"s) == "// shadow\n// bloom/inc3/x.h\n"s);
+
+    // Заголовок, добавленный между запусками на том же индексе, тоже находится
+    {
+        ofstream file("bloom/inc2/x.h");
+        file << "// inc2\n"s;
+    }
+    assert(Preprocess("bloom"_p / "main.cpp"_p, "bloom"_p / "main.in"_p, include_dirs, options));
+    assert(index.GetRebuildCount() == 2);
+    assert(GetFileContents("bloom/main.in"s) == "// shadow\n// inc2\n"s);
+}
+
+#ifdef __linux__
+/**
+ * Тестирование вывода в канал через vmsplice и splice
+ * Результат, прочитанный из канала, должен совпадать с записью в обычный файл
+ */
+void TestPipeOutput() {
+    error_code err;
+    filesystem::remove_all("pipe"_p, err);
+    filesystem::create_directories("pipe"_p, err);
+    {
+        // Заголовок без директив уходит в канал через splice
+        ofstream file("pipe/leaf.h");
+        for (int i = 0; i < 20000; ++i) {
+            file << "int leaf_" << i << ";\n";
+        }
+    }
+    {
+        ofstream file("pipe/main.cpp");
+        for (int i = 0; i < 20000; ++i) {
+            file << "int main_" << i << ";\n";
+            if (i % 5000 == 0) {
+                file << "#include \"leaf.h\"\n";
+            }
+        }
+    }
+    assert(Preprocess("pipe"_p / "main.cpp"_p, "pipe"_p / "main.in"_p, {}));
+
+    int fds[2];
+    assert(pipe(fds) == 0);
+    string piped;
+    thread reader([&]() {
+        char chunk[4096];
+        ssize_t n;
+        while ((n = read(fds[0], chunk, sizeof(chunk))) > 0) {
+            piped.append(chunk, static_cast<size_t>(n));
+        }
+    });
+    PreprocessStats stats;
+    PreprocessOptions options;
+    options.stats = &stats;
+    assert(Preprocess("pipe"_p / "main.cpp"_p, "/proc/self/fd/"s + to_string(fds[1]), {}, options));
+    close(fds[1]);
+    reader.join();
+    close(fds[0]);
+
+    assert(piped == GetFileContents("pipe/main.in"s));
+    // Файл с директивами открывается один раз, хотя сначала проверяется,
+    // нельзя ли передать его через splice
+    assert(stats.files_opened == 5);
+}
+
+/**
+ * Тестирование уничтожения приёмника до чтения канала
+ * Буферы, переданные через vmsplice в большой канал, не должны
+ * освобождаться и переиспользоваться, пока читатель их не прочитал
+ */
+void TestPipeOutputOutlivesSink() {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    if (fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024) < 1024 * 1024) {
+        // Размер канала ограничен системой: данные не поместятся без чтения
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    string expected;
+    for (int i = 0; expected.size() < 300000; ++i) {
+        expected += "line " + to_string(i) + "\n";
+    }
+    expected.resize(300000);
+    {
+        OutputSink output(fds[1]);
+        output.Write(expected);
+        assert(output.Flush());
+    }
+    // Освобождённая память приёмника была бы занята и перезаписана здесь
+    vector<unique_ptr<char[]>> garbage;
+    for (int i = 0; i < 16; ++i) {
+        garbage.push_back(make_unique<char[]>(64 * 1024));
+        memset(garbage.back().get(), '#', 64 * 1024);
+    }
+    close(fds[1]);
+
+    string piped;
+    char chunk[4096];
+    ssize_t n;
+    while ((n = read(fds[0], chunk, sizeof(chunk))) > 0) {
+        piped.append(chunk, static_cast<size_t>(n));
+    }
+    close(fds[0]);
+    assert(piped == expected);
+}
+
+/**
+ * Тестирование выдачи результата в memfd с передачей дескриптора через сокет
+ */
+void TestMemfdOutput() {
+    error_code err;
+    filesystem::remove_all("memfd"_p, err);
+    filesystem::create_directories("memfd"_p, err);
+    {
+        ofstream file("memfd/main.cpp");
+        file << "#include \"a.h\"\nint main() {}\n"s;
+    }
+    {
+        ofstream file("memfd/a.h");
+        file << "int a;\n"s;
+    }
+    // Директория, изменённая перед самым запуском, не считается неизменной;
+    // её время сдвигается в прошлое, чтобы результат можно было переиспользовать
+    const auto past = filesystem::file_time_type::clock::now() - 1h;
+    filesystem::last_write_time("memfd"_p, past, err);
+
+    int sockets[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+    MemfdOutputs outputs;
+    int fd = outputs.Get("memfd"_p / "main.cpp"_p, {});
+    assert(fd >= 0);
+    assert(SendFd(sockets[0], fd));
+    int received = ReceiveFd(sockets[1]);
+    assert(received >= 0);
+
+    // Запечатанный результат нельзя изменить
+    assert(write(received, "x", 1) < 0);
+
+    struct stat st;
+    assert(fstat(received, &st) == 0);
+    const string expected = "int a;\nint main() {}\n"s;
+    assert(static_cast<size_t>(st.st_size) == expected.size());
+    void* addr = mmap(nullptr, expected.size(), PROT_READ, MAP_SHARED, received, 0);
+    assert(addr != MAP_FAILED);
+    assert(string_view(static_cast<const char*>(addr), expected.size()) == expected);
+    munmap(addr, expected.size());
+
+    // Без изменений отдаётся тот же memfd, после изменения - новый
+    int same = outputs.Get("memfd"_p / "main.cpp"_p, {});
+    struct stat same_st;
+    assert(fstat(same, &same_st) == 0 && same_st.st_ino == st.st_ino);
+    {
+        ofstream file("memfd/a.h");
+        file << "int a = 1;\n"s;
+    }
+    int changed = outputs.Get("memfd"_p / "main.cpp"_p, {});
+    struct stat changed_st;
+    assert(fstat(changed, &changed_st) == 0 && changed_st.st_ino != st.st_ino);
+
+    for (int descriptor : {fd, received, same, changed, sockets[0], sockets[1]}) {
+        close(descriptor);
+    }
+
+    // Заголовок, перекрывший прочитанный в более ранней директории include,
+    // делает прежний результат устаревшим. Времена изменения директорий
+    // сдвигаются в прошлое, чтобы новый файл заведомо их менял
+    filesystem::create_directories("memfd"_p / "inc1"_p, err);
+    filesystem::create_directories("memfd"_p / "inc2"_p / "sub"_p, err);
+    {
+        ofstream file("memfd/shadow.cpp");
+        file << "#include <sub/x.h>\n"s;
+    }
+    {
+        ofstream file("memfd/inc2/sub/x.h");
+        file << "int inc2;\n"s;
+    }
+    for (const char* dir : {"", "inc1", "inc2", "inc2/sub"}) {
+        filesystem::last_write_time("memfd"_p / dir, past, err);
+    }
+    const vector<path> include_dirs = {"memfd"_p / "inc1"_p, "memfd"_p / "inc2"_p};
+    int original = outputs.Get("memfd"_p / "shadow.cpp"_p, include_dirs);
+    assert(original >= 0);
+    filesystem::create_directories("memfd"_p / "inc1"_p / "sub"_p, err);
+    {
+        ofstream file("memfd/inc1/sub/x.h");
+        file << "int inc1;\n"s;
+    }
+    int shadowed = outputs.Get("memfd"_p / "shadow.cpp"_p, include_dirs);
+    assert(shadowed >= 0);
+    char text[16] = {};
+    assert(pread(shadowed, text, sizeof(text), 0) == 10 && string_view(text, 10) == "int inc1;\n"sv);
+    close(original);
+    close(shadowed);
+
+    // Одновременные запросы из нескольких потоков
+    vector<thread> threads;
+    atomic<int> failures = 0;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&]() {
+            for (int i = 0; i < 20; ++i) {
+                int descriptor = outputs.Get("memfd"_p / (i % 2 ? "main.cpp"_p : "shadow.cpp"_p), include_dirs);
+                if (descriptor < 0) {
+                    ++failures;
+                } else {
+                    close(descriptor);
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    assert(failures == 0);
+
+    // Дескриптор читается обычным read с начала
+    int reader = outputs.Get("memfd"_p / "main.cpp"_p, {});
+    char buffer[64];
+    assert(read(reader, buffer, sizeof(buffer)) == 25 && string_view(buffer, 25) == "int a = 1;\nint main() {}\n"sv);
+    close(reader);
+
+    // Результаты с разными параметрами не подменяют друг друга; результат
+    // частями и индекс строк для memfd не поддерживаются
+    {
+        ofstream file("memfd/crlf.cpp", ios::binary);
+        file << "int crlf;\r\n"s;
+    }
+    PreprocessOptions normalize;
+    normalize.normalize_text = true;
+    int plain = outputs.Get("memfd"_p / "crlf.cpp"_p, {});
+    int normalized = outputs.Get("memfd"_p / "crlf.cpp"_p, {}, normalize);
+    struct stat plain_st, normalized_st;
+    assert(fstat(plain, &plain_st) == 0 && plain_st.st_size == 11);
+    assert(fstat(normalized, &normalized_st) == 0 && normalized_st.st_size == 10);
+    close(plain);
+    close(normalized);
+    PreprocessOptions chunked;
+    chunked.chunk_size = 100;
+    assert(outputs.Get("memfd"_p / "crlf.cpp"_p, {}, chunked) < 0);
+
+    // Заголовок, изменённый во время обработки после чтения, делает результат
+    // устаревшим: отметка берётся у прочитанной версии
+    {
+        ofstream file("memfd/edited.cpp");
+        file << "#include \"a.h\"\n#include \"b.h\"\n"s;
+    }
+    {
+        ofstream file("memfd/b.h");
+        file << "int b;\n"s;
+    }
+    filesystem::last_write_time("memfd"_p / "a.h"_p, past, err);
+    filesystem::last_write_time("memfd"_p, past, err);
+    int boundaries = 0;
+    PreprocessOptions editing;
+    editing.at_include_boundary = [&boundaries]() {
+        if (++boundaries == 2) {
+            ofstream file("memfd/a.h");
+            file << "int A = 1;\n"s;
+        }
+    };
+    int stale = outputs.Get("memfd"_p / "edited.cpp"_p, {}, editing);
+    int fresh = outputs.Get("memfd"_p / "edited.cpp"_p, {}, editing);
+    assert(pread(stale, buffer, sizeof(buffer), 0) == 18 && string_view(buffer, 18) == "int a = 1;\nint b;\n"sv);
+    assert(pread(fresh, buffer, sizeof(buffer), 0) == 18 && string_view(buffer, 18) == "int A = 1;\nint b;\n"sv);
+    close(stale);
+    close(fresh);
+}
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+/**
+ * Открывает канал fifo на запись, когда его начали читать, и пишет в него
+ * content. Возвращается, когда читатель забрал весь текст: до закрытия
+ * возвращённого дескриптора он ждёт конца файла, и занятый им поток не
+ * освобождается. Читатель может открыть канал несколько раз (Preprocess
+ * сначала проверяет вход, затем читает его), поэтому закрывать канал раньше нельзя
+ */
+int OpenGate(const path& fifo, string_view content) {
+    // Открытие на запись без ожидания удаётся, когда канал уже открыт на чтение
+    int fd = -1;
+    for (int i = 0; i < 5000 && fd < 0; ++i) {
+        fd = open(fifo.c_str(), O_WRONLY | O_NONBLOCK);
+        if (fd < 0) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+    assert(fd >= 0);
+    assert(write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size()));
+    int unread = 1;
+    for (int i = 0; i < 5000 && unread > 0; ++i) {
+        assert(ioctl(fd, FIONREAD, &unread) == 0);
+        if (unread > 0) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+    assert(unread == 0);
+    return fd;
+}
+#endif
+
+/**
+ * Тестирование пакетной обработки
+ */
+void TestEngine() {
+    error_code err;
+    filesystem::remove_all("engine"_p, err);
+    filesystem::create_directories("engine"_p / "include"_p, err);
+    {
+        ofstream file("engine/include/common.h");
+        file << "int common;\n"s;
+    }
+    for (int i = 0; i < 20; ++i) {
+        ofstream file("engine/tu" + to_string(i) + ".cpp");
+        file << "#include <common.h>\nint tu" << i << ";\n";
+    }
+
+    IncludeCache cache;
+    PreprocessStats stats;
+    PreprocessOptions options;
+    options.cache = &cache;
+    options.stats = &stats;
+    const vector<path> include_dirs = {"engine"_p / "include"_p};
+    for (int round = 0; round < 2; ++round) {
+        PreprocessEngine engine(3, 2, options);
+        vector<future<bool>> results;
+        for (int i = 0; i < 20; ++i) {
+            string name = "tu" + to_string(i);
+            results.push_back(engine.Submit({"engine"_p / (name + ".cpp"), "engine"_p / (name + ".in"), include_dirs}));
+        }
+        for (auto& result : results) {
+            assert(result.get());
+        }
+    }
+    for (int i = 0; i < 20; ++i) {
+        assert(GetFileContents("engine/tu" + to_string(i) + ".in") == "int common;\nint tu" + to_string(i) + ";\n");
+    }
+    assert(stats.units.size() == 40);
+    assert(stats.dirs.size() == 1 && stats.dirs[0].hits == 40);
+
+#if defined(__unix__) || defined(__APPLE__)
+    // Задания одного пакета проверяют записи кэша один раз на пакет, а не на
+    // каждое задание. Первое задание читает канал и держит движок занятым,
+    // пока отправляются остальные
+    {
+        assert(mkfifo("engine/gate.cpp", 0600) == 0);
+        const uint64_t checks_before = cache.GetOccupancy().checks;
+        {
+            PreprocessEngine engine(1, 0, options);
+            vector<future<bool>> results;
+            results.push_back(engine.Submit({"engine"_p / "gate.cpp"_p, "engine"_p / "gate.in"_p, include_dirs}));
+            for (int i = 0; i < 20; ++i) {
+                string name = "tu" + to_string(i);
+                results.push_back(engine.Submit({"engine"_p / (name + ".cpp"), "engine"_p / (name + ".in"), include_dirs}));
+            }
+            close(OpenGate("engine"_p / "gate.cpp"_p, "#include <common.h>\n"sv));
+            for (auto& result : results) {
+                assert(result.get());
+            }
+        }
+        assert(cache.GetOccupancy().checks - checks_before <= 2);
+        assert(GetFileContents("engine/gate.in"s) == "int common;\n"s);
+        filesystem::remove("engine"_p / "gate.cpp"_p, err);
+    }
+
+    // Присоединившееся задание, копию результата которого записать нельзя,
+    // завершается ошибкой и учитывается в failed. Пока первое задание читает
+    // канал, второе гарантированно присоединяется к нему
+    {
+        assert(mkfifo("engine/gate.cpp", 0600) == 0);
+        PreprocessEngine engine(1, 0);
+        future<bool> leader = engine.Submit({"engine"_p / "gate.cpp"_p, "engine"_p / "gate.in"_p, include_dirs});
+        future<bool> follower =
+            engine.Submit({"engine"_p / "gate.cpp"_p, "engine"_p / "missing"_p / "gate.in"_p, include_dirs});
+        close(OpenGate("engine"_p / "gate.cpp"_p, "int gate;\n"sv));
+        assert(leader.get());
+        assert(!follower.get());
+        ostringstream status;
+        engine.DumpStatus(status);
+        assert(status.str().find("jobs done=1 failed=1 ") == 0);
+        filesystem::remove("engine"_p / "gate.cpp"_p, err);
+    }
+#endif
+
+    // Для задания, которого движок ещё не видел, подгружаются включения
+    // из графа кэша, в том числе загруженного из снимка
+    assert(cache.SaveSnapshot("engine"_p / "warm.snapshot"_p));
+    IncludeCache loaded;
+    assert(loaded.LoadSnapshot("engine"_p / "warm.snapshot"_p));
+    for (IncludeCache* graph : {&cache, &loaded}) {
+        vector<path> includes = graph->CollectIncludes("engine"_p / "tu3.cpp"_p, graph->GetDirSetId(include_dirs));
+        assert(includes == vector<path>{"engine"_p / "include"_p / "common.h"_p});
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    // Новый движок собирает задания с общими заголовками в одном потоке по
+    // графу кэша. Оба потока заняты чтением каналов, пока задания в очередях
+    {
+        for (const char* group : {"a", "b"}) {
+            {
+                ofstream file("engine/include/group_"s + group + ".h");
+                file << "int group_" << group << ";\n";
+            }
+            for (int i = 0; i < 2; ++i) {
+                string name = "engine/g"s + group + to_string(i);
+                ofstream file(name + ".cpp");
+                file << "#include <group_" << group << ".h>\n";
+            }
+        }
+        for (const char* name : {"ga0", "ga1", "gb0", "gb1"}) {
+            assert(Preprocess("engine"_p / (name + ".cpp"s), "engine"_p / (name + ".in"s), include_dirs, options));
+        }
+        assert(mkfifo("engine/gate0.cpp", 0600) == 0 && mkfifo("engine/gate1.cpp", 0600) == 0);
+        PreprocessEngine engine(2, 0, options);
+        vector<future<bool>> results;
+        vector<int> gates;
+        for (const char* gate : {"engine/gate0.cpp", "engine/gate1.cpp"}) {
+            results.push_back(engine.Submit({gate, path(gate).replace_extension(".in"), include_dirs}));
+        }
+        for (const char* gate : {"engine/gate0.cpp", "engine/gate1.cpp"}) {
+            gates.push_back(OpenGate(gate, "int gate;\n"sv));
+        }
+        for (const char* name : {"ga0", "ga1", "gb0", "gb1"}) {
+            results.push_back(engine.Submit({"engine"_p / (name + ".cpp"s), "engine"_p / (name + ".out"s), include_dirs}));
+        }
+        vector<vector<path>> queued = engine.GetQueuedInputs();
+        assert(queued.size() == 2);
+        assert((queued[0] == vector<path>{"engine"_p / "ga0.cpp"_p, "engine"_p / "ga1.cpp"_p}));
+        assert((queued[1] == vector<path>{"engine"_p / "gb0.cpp"_p, "engine"_p / "gb1.cpp"_p}));
+        for (int fd : gates) {
+            close(fd);
+        }
+        for (auto& result : results) {
+            assert(result.get());
+        }
+        assert(GetFileContents("engine/gb1.out"s) == "int group_b;\n"s);
+        filesystem::remove("engine"_p / "gate0.cpp"_p, err);
+        filesystem::remove("engine"_p / "gate1.cpp"_p, err);
+    }
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+    // Срочное задание, отправленное во время длинного фонового, не ждёт его
+    // окончания: фоновое задание уступает поток на границе include. Фоновое
+    // задание читает канал gate.h, пока отправляется срочное, и канал hold.h,
+    // пока проверяется, что оно ещё не завершено
+    {
+        ofstream file("engine/yield.cpp");
+        file << "#include \"gate.h\"\n#include \"hold.h\"\nint yield;\n"s;
+    }
+    assert(mkfifo("engine/gate.h", 0600) == 0 && mkfifo("engine/hold.h", 0600) == 0);
+    {
+        PreprocessEngine engine(1, 0);
+        future<bool> batch = engine.Submit({"engine"_p / "yield.cpp"_p, "engine"_p / "yield.in"_p, include_dirs});
+        int gate = OpenGate("engine"_p / "gate.h"_p, "int gate;\n"sv);
+        future<bool> interactive = engine.Submit({"engine"_p / "tu0.cpp"_p, "engine"_p / "urgent.in"_p, include_dirs},
+                                                 JobPriority::kInteractive);
+        close(gate);
+        assert(interactive.get());
+        int hold = OpenGate("engine"_p / "hold.h"_p, "int hold;\n"sv);
+        assert(batch.wait_for(chrono::seconds(0)) != future_status::ready);
+        close(hold);
+        assert(batch.get());
+    }
+    assert(GetFileContents("engine/urgent.in"s) == "int common;\nint tu0;\n"s);
+    assert(GetFileContents("engine/yield.in"s) == "int gate;\nint hold;\nint yield;\n"s);
+    filesystem::remove("engine"_p / "gate.h"_p, err);
+    filesystem::remove("engine"_p / "hold.h"_p, err);
+
+    // Одинаковые задания, отправленные, пока первое не завершено, выполняются
+    // один раз. Единственный поток читает канал, пока задания отправляются
+    PreprocessStats coalesced_stats;
+    PreprocessOptions coalesced_options;
+    coalesced_options.stats = &coalesced_stats;
+    assert(mkfifo("engine/gate.cpp", 0600) == 0);
+    {
+        PreprocessEngine single(1, 0, coalesced_options);
+        vector<future<bool>> copies;
+        copies.push_back(single.Submit({"engine"_p / "gate.cpp"_p, "engine"_p / "gate.in"_p, include_dirs}));
+        int gate = OpenGate("engine"_p / "gate.cpp"_p, "int gate;\n"sv);
+        for (int i = 0; i < 5; ++i) {
+            copies.push_back(single.Submit({"engine"_p / "tu1.cpp"_p, "engine"_p / ("copy" + to_string(i) + ".in"), include_dirs}));
+        }
+        copies.push_back(single.Submit({"engine"_p / "tu1.cpp"_p, "engine"_p / "copy0.in"_p, include_dirs},
+                                       JobPriority::kInteractive));
+        close(gate);
+        for (auto& copy : copies) {
+            assert(copy.get());
+        }
+    }
+    assert(coalesced_stats.units.size() == 2);
+    for (int i = 0; i < 5; ++i) {
+        assert(GetFileContents("engine/copy" + to_string(i) + ".in") == "int common;\nint tu1;\n"s);
+    }
+    filesystem::remove("engine"_p / "gate.cpp"_p, err);
+#endif
+
+    // Движок без рабочих потоков всё равно выполняет задания
+    {
+        PreprocessEngine no_workers(0, 1);
+        assert(no_workers.Submit({"engine"_p / "tu2.cpp"_p, "engine"_p / "no_workers.in"_p, include_dirs}).get());
+    }
+    assert(GetFileContents("engine/no_workers.in"s) == "int common;\nint tu2;\n"s);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+/**
+ * Тестирование сброса состояния движка по SIGUSR1 во время работы
+ */
+void TestStatsDump() {
+    error_code err;
+    filesystem::remove_all("dump"_p, err);
+    filesystem::create_directories("dump"_p, err);
+    {
+        ofstream file("dump/common.h");
+        file << "int common;\n"s;
+    }
+    {
+        ofstream file("dump/short.cpp");
+        file << "#include \"common.h\"\n"s;
+    }
+    assert(mkfifo("dump/gate.cpp", 0600) == 0);
+
+    IncludeCache cache;
+    PreprocessStats stats;
+    PreprocessOptions options;
+    options.cache = &cache;
+    options.stats = &stats;
+    PreprocessEngine engine(1, 0, options);
+    StatsDumper dumper("dump"_p / "status.txt"_p, [&engine](ostream& out) {
+        engine.DumpStatus(out);
+    });
+    assert(engine.Submit({"dump"_p / "short.cpp"_p, "dump"_p / "short.in"_p, {}}).get());
+    // Второе задание читает канал, пока идёт сброс, поэтому оно точно выполняется
+    future<bool> running = engine.Submit({"dump"_p / "gate.cpp"_p, "dump"_p / "gate.in"_p, {"dump"_p}});
+    int gate = OpenGate("dump"_p / "gate.cpp"_p, "#include \"common.h\"\n"sv);
+
+    // Файл сброса заменяется атомарно: появившийся файл записан целиком
+    raise(SIGUSR1);
+    for (int i = 0; i < 500 && !filesystem::exists("dump"_p / "status.txt"_p, err); ++i) {
+        this_thread::sleep_for(10ms);
+    }
+    assert(dumper.GetDumpCount() >= 1);
+    const string status = GetFileContents("dump/status.txt"s);
+    close(gate);
+    assert(running.get());
+
+    assert(status.find("jobs done=1 failed=0") == 0);
+    assert(status.find("in_flight 1\n  dump/gate.cpp running_ms=") != string::npos);
+    assert(status.find("latency\n  <") != string::npos);
+    // Содержимое кэша и статистики зависит от того, когда пришёл сигнал
+    assert(status.find("cache resolutions=") != string::npos);
+    assert(status.find("files_opened=") != string::npos);
+}
+#endif
+
+/**
+ * Тестирование хранилища результатов
+ * Одинаковые результаты разных заданий хранятся одним файлом, на который
+ * ссылаются все их выходные файлы
+ */
+void TestOutputStore() {
+    error_code err;
+    filesystem::remove_all("store"_p, err);
+    filesystem::create_directories("store"_p / "include"_p, err);
+    {
+        ofstream file("store/include/stub.h");
+        file << "int stub;\n"s;
+    }
+    for (int i = 0; i < 10; ++i) {
+        ofstream file("store/stub" + to_string(i) + ".cpp");
+        file << "#include <stub.h>\n"s;
+    }
+    {
+        ofstream file("store/other.cpp");
+        file << "#include <stub.h>\nint other;\n"s;
+    }
+    {
+        // Выходной файл прошлого запуска заменяется, а не дописывается
+        ofstream file("store/stub0.in");
+        file << "stale\n"s;
+    }
+
+    const vector<path> include_dirs = {"store"_p / "include"_p};
+    OutputStore output_store("store"_p / "blobs"_p);
+    {
+        PreprocessEngine engine(3, 1, {}, &output_store);
+        vector<future<bool>> results;
+        for (int i = 0; i < 10; ++i) {
+            string name = "stub" + to_string(i);
+            results.push_back(engine.Submit({"store"_p / (name + ".cpp"), "store"_p / (name + ".in"), include_dirs}));
+        }
+        results.push_back(engine.Submit({"store"_p / "other.cpp"_p, "store"_p / "other.in"_p, include_dirs}));
+        results.push_back(engine.Submit({"store"_p / "other.cpp"_p, "store"_p / "other_copy.in"_p, include_dirs}));
+        for (auto& result : results) {
+            assert(result.get());
+        }
+    }
+
+    assert(output_store.GetStoredCount() == 2);
+    for (int i = 0; i < 10; ++i) {
+        path output = "store"_p / ("stub" + to_string(i) + ".in");
+        assert(GetFileContents(output.string()) == "int stub;\n"s);
+        assert(filesystem::equivalent(output, "store"_p / "stub0.in"_p));
+    }
+    assert(GetFileContents("store/other_copy.in"s) == "int stub;\nint other;\n"s);
+    assert(filesystem::equivalent("store"_p / "other.in"_p, "store"_p / "other_copy.in"_p));
+    assert(filesystem::is_empty("store"_p / "blobs"_p / "tmp"_p));
+
+    // Обычная запись в выходной файл не меняет хранимый результат и другие ссылки на него
+    {
+        ofstream file("store/stub1.cpp");
+        file << "#include <stub.h>\nint edited;\n"s;
+    }
+    assert(Preprocess("store"_p / "stub1.cpp"_p, "store"_p / "stub1.in"_p, include_dirs));
+    assert(GetFileContents("store/stub1.in"s) == "int stub;\nint edited;\n"s);
+    assert(GetFileContents("store/stub2.in"s) == "int stub;\n"s);
+
+    // Жёсткую ссылку, сделанную не хранилищем, запись не разрывает
+    {
+        ofstream file("store/own.in");
+        file << "old\n"s;
+    }
+    filesystem::create_hard_link("store"_p / "own.in"_p, "store"_p / "own_link.in"_p, err);
+    assert(!err);
+    assert(Preprocess("store"_p / "stub1.cpp"_p, "store"_p / "own.in"_p, include_dirs));
+    assert(filesystem::equivalent("store"_p / "own.in"_p, "store"_p / "own_link.in"_p));
+    assert(GetFileContents("store/own_link.in"s) == "int stub;\nint edited;\n"s);
+
+    // Другой результат под тем же именем не используется вместо добавляемого
+    const string text = "int collision;\n"s;
+    ostringstream name;
+    name << hex << setfill('0') << setw(16) << HashString(text) << setw(16)
+         << HashString(text, 0x9e3779b97f4a7c15ull) << '-' << dec << text.size();
+    {
+        ofstream file("store"_p / "blobs"_p / name.str());
+        file << "int other_text;\n"s;
+    }
+    path tmp_file = output_store.MakeTempFile();
+    {
+        ofstream file(tmp_file);
+        file << text;
+    }
+    optional<path> blob = output_store.Add(tmp_file);
+    assert(blob && blob->filename() == name.str() + "-1");
+    assert(GetFileContents(blob->string()) == text);
+}
+
+/**
+ * Синтетическое дерево исходных файлов для бенчмарка
+ */
+struct BenchTree {
+    string shape;              // название формы дерева
+    path input_file;           // корневой файл
+    vector<path> include_dirs; // директории include
+};
+
+/**
+ * Записывает файл бенчмарка: сначала директивы include, затем строки кода
+ *
+ * @param file - путь к файлу
+ * @param includes - готовые строки директив
+ * @param lines - число строк кода
+ * @param tag - метка, делающая строки файла уникальными
+ */
+void WriteBenchFile(const path& file, const vector<string>& includes, int lines, const string& tag) {
+    ofstream out(file);
+    for (const auto& include : includes) {
+        out << include << '\n';
+    }
+    for (int i = 0; i < lines; ++i) {
+        out << "int " << tag << "_v" << i << " = " << i << ";\n";
+    }
+}
+
+/**
+ * Цепочка: каждый файл включает следующий, глубина вложенности максимальна
+ */
+BenchTree MakeChainTree(const path& root, int depth, int lines) {
+    filesystem::create_directories(root / "include"_p);
+    for (int i = depth - 1; i >= 0; --i) {
+        vector<string> includes;
+        if (i + 1 < depth) {
+            includes.push_back("#include <chain" + to_string(i + 1) + ".h>");
+        }
+        WriteBenchFile(root / "include"_p / ("chain" + to_string(i) + ".h"), includes, lines, "c" + to_string(i));
+    }
+    WriteBenchFile(root / "main.cpp"_p, {"#include <chain0.h>"}, lines, "main");
+    return {"chain", root / "main.cpp"_p, {root / "include"_p}};
+}
+
+/**
+ * Веер: корневой файл включает много независимых заголовков из нескольких
+ * директорий, так что поиск проходит по всему списку include
+ */
+BenchTree MakeFanoutTree(const path& root, int headers, int dirs, int lines) {
+    BenchTree tree{"fanout", root / "main.cpp"_p, {}};
+    for (int d = 0; d < dirs; ++d) {
+        tree.include_dirs.push_back(root / ("dir" + to_string(d)));
+        filesystem::create_directories(tree.include_dirs.back());
+    }
+    vector<string> includes;
+    for (int h = 0; h < headers; ++h) {
+        string name = "fan" + to_string(h) + ".h";
+        WriteBenchFile(tree.include_dirs[h % dirs] / name, {}, lines, "f" + to_string(h));
+        includes.push_back("#include <" + name + ">");
+    }
+    WriteBenchFile(tree.input_file, includes, lines, "main");
+    return tree;
+}
+
+/**
+ * Ромб: каждый файл слоя включает все файлы следующего слоя, поэтому
+ * общие заголовки разворачиваются многократно
+ */
+BenchTree MakeDiamondTree(const path& root, int layers, int width, int lines) {
+    filesystem::create_directories(root / "include"_p);
+    vector<string> next_includes;
+    for (int layer = layers - 1; layer >= 0; --layer) {
+        vector<string> includes;
+        for (int w = 0; w < width; ++w) {
+            string name = "d" + to_string(layer) + "_" + to_string(w) + ".h";
+            WriteBenchFile(root / "include"_p / name, next_includes, lines, "d" + to_string(layer) + "_" + to_string(w));
+            includes.push_back("#include \"" + name + "\"");
+        }
+        next_includes = move(includes);
+    }
+    WriteBenchFile(root / "main.cpp"_p, next_includes, lines, "main");
+    return {"diamond", root / "main.cpp"_p, {root / "include"_p}};
+}
+
+/**
+ * Сохраняет обезличенную форму графа include реального запуска: размеры
+ * файлов, номера строк директив, рёбра и раскладку по директориям
+ * Имена файлов и директорий заменяются номерами, содержимое не сохраняется,
+ * поэтому форму можно передать, не раскрывая исходный код
+ * Формат файла описан в ReplayGraphShape
+ *
+ * @param input_file - входной файл реального проекта
+ * @param include_dirs - его директории include
+ * @param shape_file - файл для сохранения формы
+ * @return true в случае успеха
+ */
+bool CaptureGraphShape(const path& input_file, const vector<path>& include_dirs, const path& shape_file) {
+    // Группа файла: номер директории include, затем директория входного
+    // файла, затем все остальные файлы без раскладки по директориям
+    const size_t source_group = include_dirs.size();
+    const size_t other_group = source_group + 1;
+    vector<path> group_roots = include_dirs;
+    group_roots.push_back(input_file.parent_path());
+
+    struct FileShape {
+        size_t group;
+        string subdir; // обезличенная поддиректория внутри группы
+        size_t lines = 0;
+        size_t bytes = 0;
+    };
+    vector<FileShape> files;
+    vector<path> real_files;
+    map<path, size_t> ids;
+    map<pair<size_t, string>, string> subdir_names;
+
+    // Обезличенный путь реальной поддиректории группы, d<N> на каждый уровень
+    function<string(size_t, const path&)> anonymize = [&](size_t group, const path& subdir) -> string {
+        if (subdir.empty()) {
+            return ".";
+        }
+        auto [it, inserted] = subdir_names.try_emplace({group, subdir.generic_string()});
+        if (inserted) {
+            string parent = anonymize(group, subdir.parent_path());
+            it->second = (parent == "." ? "" : parent + "/") + "d" + to_string(subdir_names.size());
+        }
+        return it->second;
+    };
+    auto get_id = [&](const path& file) {
+        path normal = file.lexically_normal();
+        auto [it, inserted] = ids.try_emplace(normal, files.size());
+        if (inserted) {
+            FileShape shape{other_group, "."};
+            for (size_t group = 0; group < group_roots.size(); ++group) {
+                path relative = normal.lexically_relative(group_roots[group].lexically_normal());
+                if (!relative.empty() && *relative.begin() != "..") {
+                    shape.group = group;
+                    shape.subdir = anonymize(group, relative.parent_path());
+                    break;
+                }
+            }
+            files.push_back(shape);
+            real_files.push_back(normal);
+        }
+        return it->second;
+    };
+
+    PreprocessOptions options;
+    PreprocessContext ctx{include_dirs, options};
+    ostringstream edges;
+    get_id(input_file);
+    for (size_t id = 0; id < real_files.size(); ++id) {
+        const path current_file = real_files[id];
+        MappedFile mapped(current_file);
+        if (!mapped.IsOpen()) {
+            cout << "Ошибка: Не удалось открыть файл: " << current_file.string() << endl;
+            return false;
+        }
+        const string_view data = mapped.Data();
+        files[id].bytes = data.size();
+        size_t line_start = 0;
+        while (line_start < data.size()) {
+            size_t line_end = data.find('\n', line_start);
+            line_end = line_end == string_view::npos ? data.size() : line_end;
+            ++files[id].lines;
+            IncludeDirective directive;
+            path full_path;
+            if (FindIncludeDirective(data.substr(line_start, line_end - line_start), directive)
+                && ResolveInclude(ctx, directive, current_file, full_path)) {
+                // near - файл найден рядом с включающим, а не в директориях include
+                bool near = directive.local && full_path == current_file.parent_path() / directive.name;
+                size_t target = get_id(full_path);
+                edges << "include " << id << ' ' << files[id].lines << ' ' << (directive.local ? '"' : '<') << ' '
+                      << (near ? 1 : 0) << ' ' << target << '\n';
+            }
+            line_start = line_end + 1;
+        }
+    }
+
+    ofstream out(shape_file);
+    out << "# include graph shape\n";
+    out << "groups " << include_dirs.size() << '\n';
+    for (size_t id = 0; id < files.size(); ++id) {
+        out << "file " << id << ' ' << files[id].group << ' ' << files[id].subdir << ' ' << files[id].lines << ' '
+            << files[id].bytes << '\n';
+    }
+    out << edges.str();
+    return static_cast<bool>(out);
+}
+
+/**
+ * Строит синтетическое дерево по форме, сохранённой CaptureGraphShape
+ *
+ * Формат формы, по строке на запись:
+ *   groups <число директорий include>
+ *   file <номер> <группа> <поддиректория> <строк> <байт>
+ *   include <из файла> <строка> <" или <> <рядом: 0/1> <в файл>
+ * Группа - номер директории include, затем директория входного файла, затем
+ * прочие файлы. Файл 0 - входной
+ *
+ * @param shape_file - файл формы
+ * @param root - директория для дерева
+ * @return дерево или nullopt, если форма повреждена
+ */
+optional<BenchTree> ReplayGraphShape(const path& shape_file, const path& root) {
+    struct FileShape {
+        path file;
+        size_t group = 0;
+        size_t lines = 0;
+        size_t bytes = 0;
+        map<size_t, string> directives; // по номеру строки
+    };
+    struct Edge {
+        size_t from;
+        size_t line;
+        char quote;
+        bool near;
+        size_t to;
+    };
+
+    ifstream in(shape_file);
+    if (!in) {
+        cout << "Ошибка: Не удалось открыть файл формы: " << shape_file.string() << endl;
+        return nullopt;
+    }
+    size_t group_count = 0;
+    vector<FileShape> files;
+    vector<Edge> edges;
+    BenchTree tree{"replay", {}, {}};
+    string line;
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string kind;
+        fields >> kind;
+        if (kind == "groups") {
+            fields >> group_count;
+            for (size_t group = 0; group < group_count; ++group) {
+                tree.include_dirs.push_back(root / ("inc" + to_string(group)));
+            }
+        } else if (kind == "file") {
+            size_t id;
+            string subdir;
+            FileShape shape;
+            fields >> id >> shape.group >> subdir >> shape.lines >> shape.bytes;
+            if (!fields || id != files.size() || shape.group > group_count + 1) {
+                return nullopt;
+            }
+            path dir = shape.group < group_count ? tree.include_dirs[shape.group]
+                       : shape.group == group_count ? root / "src"_p : root / "other"_p;
+            shape.file = (dir / subdir / (id == 0 ? "main.cpp"s : "f" + to_string(id) + ".h")).lexically_normal();
+            files.push_back(move(shape));
+        } else if (kind == "include") {
+            Edge edge;
+            fields >> edge.from >> edge.line >> edge.quote >> edge.near >> edge.to;
+            if (!fields) {
+                return nullopt;
+            }
+            edges.push_back(edge);
+        }
+    }
+    if (files.empty()) {
+        return nullopt;
+    }
+    for (const auto& dir : tree.include_dirs) {
+        filesystem::create_directories(dir);
+    }
+
+    for (const auto& edge : edges) {
+        if (edge.from >= files.size() || edge.to >= files.size()) {
+            return nullopt;
+        }
+        const FileShape& target = files[edge.to];
+        // Имя в директиве выбирается так, чтобы поиск шёл тем же путём:
+        // рядом с включающим файлом или по директориям include
+        path name = edge.near || target.group >= group_count
+                        ? target.file.lexically_relative(files[edge.from].file.parent_path())
+                        : target.file.lexically_relative(tree.include_dirs[target.group]);
+        string open = edge.quote == '<' ? "<" : "\"";
+        string close = edge.quote == '<' ? ">" : "\"";
+        files[edge.from].directives[edge.line] = "#include " + open + name.generic_string() + close;
+    }
+
+    for (size_t id = 0; id < files.size(); ++id) {
+        const FileShape& shape = files[id];
+        filesystem::create_directories(shape.file.parent_path());
+        size_t directive_bytes = 0;
+        for (const auto& [line_number, text] : shape.directives) {
+            directive_bytes += text.size() + 1;
+        }
+        const size_t filler_lines = shape.lines > shape.directives.size() ? shape.lines - shape.directives.size() : 0;
+        const size_t filler_bytes = shape.bytes > directive_bytes ? shape.bytes - directive_bytes : 0;
+        const size_t filler_length = filler_lines ? max<size_t>(filler_bytes / filler_lines, 1) - 1 : 0;
+
+        ofstream out(shape.file);
+        for (size_t line_number = 1; line_number <= shape.lines; ++line_number) {
+            auto it = shape.directives.find(line_number);
+            if (it != shape.directives.end()) {
+                out << it->second << '\n';
+                continue;
+            }
+            string filler = "int s" + to_string(id) + "_" + to_string(line_number) + ";";
+            filler.resize(max(filler.size(), filler_length), ' ');
+            out << filler << '\n';
+        }
+    }
+    tree.input_file = files[0].file;
+    return tree;
+}
+
+// Экранирует строку для передачи в командную оболочку
+string ShellQuote(const string& value) {
+    string result = "'";
+    for (char c : value) {
+        if (c == '\'') {
+            result += "'\\''";
+        } else {
+            result += c;
+        }
+    }
+    return result + "'";
+}
+
+/**
+ * Вытесняет файлы директории из страничного кэша (posix_fadvise DONTNEED,
+ * права root не нужны), чтобы следующее чтение шло с диска
+ * Грязные страницы ядро не вытесняет, поэтому файлы сначала сбрасываются
+ *
+ * @param root - директория, обходится рекурсивно
+ * @return число вытесненных файлов; 0, если платформа этого не умеет
+ */
+size_t EvictFromPageCache(const path& root) {
+    size_t evicted = 0;
+#if (defined(__unix__) || defined(__APPLE__)) && defined(POSIX_FADV_DONTNEED)
+    error_code err;
+    filesystem::recursive_directory_iterator it(root, err), end;
+    for (; !err && it != end; it.increment(err)) {
+        error_code entry_err;
+        if (!it->is_regular_file(entry_err)) {
+            continue;
+        }
+        int fd = open(it->path().c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        fdatasync(fd);
+        if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0) {
+            ++evicted;
+        }
+        close(fd);
+    }
+#else
+    (void)root;
+#endif
+    return evicted;
+}
+
+/**
+ * Замеряет лучшее время выполнения функции за несколько повторов
+ *
+ * @param prepare - вызывается перед каждым повтором, не входит в замер
+ * @return время в секундах или -1, если функция сообщила об ошибке
+ */
+template <typename Func>
+double MeasureBest(int iterations, Func func, const function<void()>& prepare = {}) {
+    double best = -1;
+    for (int i = 0; i < iterations; ++i) {
+        if (prepare) {
+            prepare();
+        }
+        auto start = chrono::steady_clock::now();
+        if (!func()) {
+            return -1;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        best = (best < 0 || seconds < best) ? seconds : best;
+    }
+    return best;
+}
+
+/**
+ * Калибровка порогов выбора способа чтения: для файлов разного размера
+ * замеряет чтение через read и mmap в страничном кэше, а для больших
+ * файлов ещё read и O_DIRECT с диска, и выбирает пороги, начиная с которых
+ * mmap и O_DIRECT выигрывают на всех бо́льших размерах
+ *
+ * @param dir - директория для временных файлов, на той ФС, которую калибруем
+ * @param report - куда вывести таблицу замеров
+ * @return подобранные пороги
+ */
+IoPolicy CalibrateIoPolicy(const path& dir, ostream& report) {
+    const size_t kMaxSize = 64 * 1024 * 1024;
+    const size_t kColdMinSize = 1024 * 1024;
+    error_code err;
+    filesystem::remove_all(dir, err);
+    filesystem::create_directories(dir);
+
+    // Время одного чтения файла с просмотром всего содержимого
+    auto measure = [](const path& file, ReadMethod method, size_t repeats, const function<void()>& prepare) {
+        size_t lines = 0;
+        double seconds = MeasureBest(3, [&]() {
+            for (size_t i = 0; i < repeats; ++i) {
+                MappedFile input(file, IoPolicy::Forced(method));
+                const string_view data = input.Data();
+                lines += count(data.begin(), data.end(), '\n');
+            }
+            return true;
+        }, prepare);
+        return lines > 0 ? seconds / repeats : -1.0;
+    };
+
+    struct Sample {
+        size_t size;
+        double read;
+        double mmap;
+        double cold_read = -1;
+        double direct = -1;
+    };
+    vector<Sample> samples;
+    report << "size_bytes  read_us  mmap_us  cold_read_us  direct_us" << endl;
+    for (size_t size = 1024; size <= kMaxSize; size *= 4) {
+        const path file = dir / ("io" + to_string(size));
+        {
+            ofstream out(file, ios::binary);
+            string line(63, 'x');
+            line += '\n';
+            for (size_t written = 0; written < size; written += line.size()) {
+                out << line;
+            }
+        }
+        // Повторы выравнивают объём замера для маленьких файлов
+        const size_t repeats = max<size_t>(1, kMaxSize / 16 / size);
+        Sample sample{size, measure(file, ReadMethod::kRead, repeats, {}), measure(file, ReadMethod::kMmap, repeats, {})};
+        if (size >= kColdMinSize) {
+            auto evict = [&dir]() {
+                EvictFromPageCache(dir);
+            };
+            sample.cold_read = measure(file, ReadMethod::kRead, 1, evict);
+            sample.direct = measure(file, ReadMethod::kDirect, 1, evict);
+        }
+        samples.push_back(sample);
+        report << setw(10) << size << fixed << setprecision(1) << setw(9) << sample.read * 1e6 << setw(9)
+               << sample.mmap * 1e6;
+        if (sample.direct >= 0) {
+            report << setw(14) << sample.cold_read * 1e6 << setw(11) << sample.direct * 1e6;
+        } else {
+            report << setw(14) << "-" << setw(11) << "-";
+        }
+        report << endl;
+        filesystem::remove(file, err);
+    }
+
+    // Порог - наименьший размер, начиная с которого способ не проигрывает ни разу
+    IoPolicy policy;
+    policy.mmap_threshold = numeric_limits<size_t>::max();
+    policy.direct_threshold = 0;
+    for (auto it = samples.rbegin(); it != samples.rend() && it->mmap <= it->read; ++it) {
+        policy.mmap_threshold = it->size;
+    }
+    for (auto it = samples.rbegin(); it != samples.rend() && it->direct >= 0 && it->direct < it->cold_read; ++it) {
+        policy.direct_threshold = it->size;
+    }
+    report << "mmap_threshold=" << policy.mmap_threshold << " direct_threshold=" << policy.direct_threshold << endl;
+    return policy;
+}
+
+/**
+ * Бенчмарк файлов из одной очень длинной строки (как минифицированные
+ * сгенерированные исходники): время должно расти линейно с размером
+ *
+ * @param root - директория для файлов бенчмарка
+ * @param prepare - вызывается перед каждым повтором (см. MeasureBest)
+ */
+void RunLongLineBenchmark(const path& root, const function<void()>& prepare) {
+    filesystem::create_directories(root);
+    // Фрагмент с символами '#', чтобы поиск директив не пропускал строку целиком
+    const string fragment = "int a#b = 1; /* # incl */ "s;
+
+    cout << "single-line MB  preprocess_ms  ms_per_MB" << endl;
+    for (size_t megabytes : {25, 50, 100}) {
+        const path input_file = root / ("line" + to_string(megabytes) + ".cpp");
+        {
+            ofstream out(input_file, ios::binary);
+            string block;
+            while (block.size() < 1024 * 1024) {
+                block += fragment;
+            }
+            block.resize(1024 * 1024);
+            for (size_t i = 0; i < megabytes; ++i) {
+                out << block;
+            }
+        }
+        const path output_file = root / "out.pp"_p;
+        double seconds = MeasureBest(3, [&]() {
+            return Preprocess(input_file, output_file, {});
+        }, prepare);
+        cout << setw(14) << megabytes << fixed << setprecision(2) << setw(15) << seconds * 1000
+             << setw(11) << seconds * 1000 / megabytes << endl;
+        error_code err;
+        filesystem::remove(input_file, err);
+    }
+}
+
+/**
+ * Бенчмарк перекодировки: один и тот же исходник в UTF-8 и в UTF-16LE.
+ * Время на мегабайт текста UTF-8 должно быть сопоставимым
+ *
+ * @param root - директория для файлов бенчмарка
+ * @param prepare - вызывается перед каждым повтором (см. MeasureBest)
+ */
+void RunUtf16Benchmark(const path& root, const function<void()>& prepare) {
+    filesystem::create_directories(root);
+    string text;
+    for (int i = 0; text.size() < 32 * 1024 * 1024; ++i) {
+        text += "int value_" + to_string(i) + " = " + to_string(i * 7) + "; // значение\n";
+    }
+    const double megabytes = static_cast<double>(text.size()) / (1024 * 1024);
+    {
+        ofstream out(root / "utf8.cpp"_p, ios::binary);
+        out << text;
+    }
+    {
+        // Текст из ASCII и кириллицы: все символы в BMP, по два байта на символ
+        string utf16 = "\xFF\xFE"s;
+        for (size_t i = 0; i < text.size();) {
+            auto byte = static_cast<unsigned char>(text[i]);
+            uint32_t code = byte;
+            if (byte >= 0x80) {
+                code = ((byte & 0x1F) << 6) | (static_cast<unsigned char>(text[i + 1]) & 0x3F);
+                i += 2;
+            } else {
+                ++i;
+            }
+            utf16 += static_cast<char>(code & 0xFF);
+            utf16 += static_cast<char>(code >> 8);
+        }
+        ofstream out(root / "utf16.cpp"_p, ios::binary);
+        out << utf16;
+    }
+
+    cout << "encoding  preprocess_ms  ms_per_MB" << endl;
+    for (const char* name : {"utf8", "utf16"}) {
+        const path input_file = root / (string(name) + ".cpp");
+        const path output_file = root / "out.pp"_p;
+        double seconds = MeasureBest(3, [&]() {
+            return Preprocess(input_file, output_file, {});
+        }, prepare);
+        cout << setw(8) << name << fixed << setprecision(2) << setw(15) << seconds * 1000
+             << setw(11) << seconds * 1000 / megabytes << endl;
+    }
+}
+
+/**
+ * Бенчмарк распределения заданий по рабочим потокам: группы единиц
+ * трансляции с общими заголовками отправляются вперемешку, и сравнивается
+ * выполнение с учётом общих файлов и без него. Первый проход запоминает
+ * прочитанные файлы, замеряется второй
+ *
+ * @param root - директория для файлов бенчмарка
+ */
+void RunAffinityBenchmark(const path& root) {
+    const int groups = 8;
+    const int units_per_group = 24;
+    const int headers_per_group = 40;
+    const size_t workers = 4;
+
+    vector<path> include_dirs;
+    vector<PreprocessJob> jobs;
+    for (int g = 0; g < groups; ++g) {
+        const path dir = root / ("group" + to_string(g));
+        filesystem::create_directories(dir);
+        include_dirs.push_back(dir);
+        vector<string> includes;
+        for (int h = 0; h < headers_per_group; ++h) {
+            string name = "g" + to_string(g) + "_" + to_string(h) + ".h";
+            WriteBenchFile(dir / name, {}, 200, "g" + to_string(g) + "_" + to_string(h));
+            includes.push_back("#include <" + name + ">");
+        }
+        for (int u = 0; u < units_per_group; ++u) {
+            string name = "g" + to_string(g) + "_tu" + to_string(u);
+            WriteBenchFile(root / (name + ".cpp"), includes, 50, name);
+        }
+    }
+    // Вперемешку, в постоянном случайном порядке
+    for (int u = 0; u < units_per_group; ++u) {
+        for (int g = 0; g < groups; ++g) {
+            string name = "g" + to_string(g) + "_tu" + to_string(u);
+            jobs.push_back({root / (name + ".cpp"), root / (name + ".pp"), include_dirs});
+        }
+    }
+    shuffle(jobs.begin(), jobs.end(), mt19937(42));
+
+    cout << "affinity  batch_ms  worker_files  llc_misses" << endl;
+    for (bool affinity : {false, true}) {
+        PreprocessStats stats;
+        PreprocessOptions options;
+        options.stats = &stats;
+        PreprocessEngine engine(workers, 0, options, nullptr, affinity);
+        auto run_batch = [&]() {
+            vector<future<bool>> results;
+            for (const auto& job : jobs) {
+                results.push_back(engine.Submit(job));
+            }
+            bool success = true;
+            for (auto& result : results) {
+                success = result.get() && success;
+            }
+            return success;
+        };
+        run_batch();
+        engine.TakeWorkerFootprint();
+        stats = {};
+        double seconds = MeasureBest(1, run_batch);
+
+        uint64_t llc_misses = 0;
+        for (const auto& counters : stats.total) {
+            llc_misses += counters.llc_misses;
+        }
+        cout << setw(8) << (affinity ? "on" : "off") << fixed << setprecision(2) << setw(10) << seconds * 1000
+             << setw(14) << engine.TakeWorkerFootprint();
+        if (stats.hw_counters) {
+            cout << setw(12) << llc_misses;
+        } else {
+            cout << setw(12) << "-";
+        }
+        cout << endl;
+    }
+}
+
+/**
+ * Бенчмарк стадии подгрузки на медленном хранилище: перед каждым повтором
+ * файлы вытесняются из страничного кэша, и пакет единиц трансляции со
+ * своими заголовками выполняется движком без потоков подгрузки и с ними.
+ * Выводится время пакета и наибольшее число заданий, чьё чтение уже
+ * запрошено, пока они ждут рабочего потока (TakePeakPrefetched).
+ * Кэш вытесняется независимо от --cold: на горячем кэше подгружать нечего
+ *
+ * @param root - директория для файлов бенчмарка
+ */
+void RunPrefetchBenchmark(const path& root) {
+    const int units = 192;
+    const int headers_per_unit = 8;
+    const size_t workers = 2;
+
+    vector<PreprocessJob> jobs;
+    filesystem::create_directories(root / "include"_p);
+    for (int u = 0; u < units; ++u) {
+        vector<string> includes;
+        for (int h = 0; h < headers_per_unit; ++h) {
+            string name = "u" + to_string(u) + "_" + to_string(h) + ".h";
+            WriteBenchFile(root / "include"_p / name, {}, 400, "u" + to_string(u) + "_" + to_string(h));
+            includes.push_back("#include <" + name + ">");
+        }
+        string name = "tu" + to_string(u);
+        WriteBenchFile(root / (name + ".cpp"), includes, 50, name);
+        jobs.push_back({root / (name + ".cpp"), root / (name + ".pp"), {root / "include"_p}});
+    }
+
+    function<void()> prepare = [&root]() {
+        EvictFromPageCache(root);
+    };
+    if (EvictFromPageCache(root) == 0) {
+        prepare = {};
+    }
+    cout << "prefetch, page cache: " << (prepare ? "cold" : "warm") << endl;
+    cout << "io_threads  batch_ms  peak_prefetched" << endl;
+    for (size_t io_threads : {size_t{0}, size_t{16}}) {
+        // Граф включений известен кэшу, как после загрузки снимка
+        IncludeCache cache;
+        PreprocessOptions options;
+        options.cache = &cache;
+        PreprocessEngine engine(workers, io_threads, options);
+        auto run_batch = [&]() {
+            vector<future<bool>> results;
+            for (const auto& job : jobs) {
+                results.push_back(engine.Submit(job));
+            }
+            bool success = true;
+            for (auto& result : results) {
+                success = result.get() && success;
+            }
+            return success;
+        };
+        run_batch();
+        engine.TakePeakPrefetched();
+        double seconds = MeasureBest(3, run_batch, prepare);
+        cout << setw(10) << io_threads << fixed << setprecision(2) << setw(10) << seconds * 1000 << setw(17)
+             << engine.TakePeakPrefetched() << endl;
+    }
+}
+
+/**
+ * Бенчмарк: прогоняет синтетические деревья через Preprocess и, если он
+ * установлен, через `cpp -E -P`, и выводит для каждой формы дерева время,
+ * пропускную способность и размеры результатов
+ * Время cpp включает запуск процесса, как при реальном использовании
+ *
+ * @param cold - вытеснять файлы бенчмарка из страничного кэша перед каждым
+ *               повтором, чтобы замерить чтение с диска, как в чистой сборке
+ * @param shape_file - форма реального графа include (см. CaptureGraphShape),
+ *                     по которой строится ещё одно дерево; пустой путь - нет
+ */
+void RunBenchmarks(bool cold, const path& shape_file) {
+    const path root = "bench"_p;
+    const int iterations = 5;
+    error_code err;
+    filesystem::remove_all(root, err);
+
+    vector<BenchTree> trees = {
+        MakeChainTree(root / "chain"_p, 150, 200),
+        MakeFanoutTree(root / "fanout"_p, 400, 40, 100),
+        MakeDiamondTree(root / "diamond"_p, 8, 2, 100),
+    };
+    if (!shape_file.empty()) {
+        optional<BenchTree> replay = ReplayGraphShape(shape_file, root / "replay"_p);
+        if (!replay) {
+            cout << "Ошибка: Повреждён файл формы: " << shape_file.string() << endl;
+            return;
+        }
+        trees.push_back(move(*replay));
+    }
+
+    function<void()> prepare;
+    if (cold) {
+        prepare = [&root]() {
+            EvictFromPageCache(root);
+        };
+        if (EvictFromPageCache(root) == 0) {
+            cout << "page cache eviction is not supported, running warm" << endl;
+            prepare = {};
+        }
+    }
+    cout << "page cache: " << (prepare ? "cold" : "warm") << endl;
+
+    const bool has_cpp = system("cpp --version > /dev/null 2>&1") == 0;
+    if (!has_cpp) {
+        cout << "cpp not found, comparison skipped" << endl;
+    }
+
+    cout << "shape      preprocess_ms  MB/s      cpp_ms     MB/s      speedup  out_bytes  cpp_out_bytes  size_diff" << endl;
+    for (const auto& tree : trees) {
+        const path output_file = tree.input_file.parent_path() / "out.pp"_p;
+        double seconds = MeasureBest(iterations, [&]() {
+            return Preprocess(tree.input_file, output_file, tree.include_dirs);
+        }, prepare);
+        uintmax_t out_bytes = filesystem::file_size(output_file, err);
+
+        double cpp_seconds = -1;
+        uintmax_t cpp_bytes = 0;
+        if (has_cpp) {
+            const path cpp_output = tree.input_file.parent_path() / "out.cpp"_p;
+            string command = "cpp -E -P";
+            for (const auto& dir : tree.include_dirs) {
+                command += " -I " + ShellQuote(dir.string());
+            }
+            command += " " + ShellQuote(tree.input_file.string()) + " -o " + ShellQuote(cpp_output.string());
+            cpp_seconds = MeasureBest(iterations, [&]() {
+                return system(command.c_str()) == 0;
+            }, prepare);
+            cpp_bytes = filesystem::file_size(cpp_output, err);
+        }
+
+        auto throughput = [](uintmax_t bytes, double secs) {
+            return secs > 0 ? bytes / secs / (1024 * 1024) : 0.0;
+        };
+        cout << left << setw(11) << tree.shape << right << fixed << setprecision(2)
+             << setw(13) << seconds * 1000 << setw(9) << throughput(out_bytes, seconds);
+        if (cpp_seconds > 0) {
+            cout << setw(12) << cpp_seconds * 1000 << setw(9) << throughput(cpp_bytes, cpp_seconds)
+                 << setw(9) << cpp_seconds / seconds << setw(11) << out_bytes << setw(15) << cpp_bytes
+                 << setw(10) << (cpp_bytes ? 100.0 * (static_cast<double>(out_bytes) - cpp_bytes) / cpp_bytes : 0.0) << '%';
+        } else {
+            cout << setw(12) << "-" << setw(9) << "-" << setw(9) << "-" << setw(11) << out_bytes
+                 << setw(15) << "-" << setw(11) << "-";
+        }
+        cout << endl;
+    }
+
+    RunLongLineBenchmark(root / "long_line"_p, prepare);
+    RunUtf16Benchmark(root / "utf16"_p, prepare);
+    RunAffinityBenchmark(root / "affinity"_p);
+    RunPrefetchBenchmark(root / "prefetch"_p);
+}
+
+/**
+ * Тестирование сохранения и воспроизведения формы графа include
+ * Дерево, построенное по форме, даёт ту же форму, но без исходных имён
+ */
+void TestGraphShape() {
+    error_code err;
+    filesystem::remove_all("shape"_p, err);
+    filesystem::create_directories("shape"_p / "src"_p, err);
+    filesystem::create_directories("shape"_p / "include"_p / "secret_module"_p, err);
+    {
+        ofstream file("shape/src/main.cpp");
+        file << "#include \"private_config.h\"\nint secret_main;\n#include <secret_module/api.h>\n"s;
+    }
+    {
+        ofstream file("shape/src/private_config.h");
+        file << "int secret_config;\n#include <common.h>\n"s;
+    }
+    {
+        ofstream file("shape/include/secret_module/api.h");
+        file << "#include \"../common.h\"\nint secret_api;\nint secret_api2;\n"s;
+    }
+    {
+        ofstream file("shape/include/common.h");
+        file << "int secret_common;\n"s;
+    }
+
+    const vector<path> include_dirs = {"shape"_p / "include"_p};
+    assert(CaptureGraphShape("shape"_p / "src"_p / "main.cpp"_p, include_dirs, "shape"_p / "real.shape"_p));
+    const string shape = GetFileContents("shape/real.shape"s);
+    assert(shape.find("secret") == string::npos && shape.find("common") == string::npos);
+
+    optional<BenchTree> replay = ReplayGraphShape("shape"_p / "real.shape"_p, "shape"_p / "replay"_p);
+    assert(replay);
+    assert(Preprocess("shape"_p / "src"_p / "main.cpp"_p, "shape"_p / "real.in"_p, include_dirs));
+    assert(Preprocess(replay->input_file, "shape"_p / "replay.in"_p, replay->include_dirs));
+    auto count_lines = [](const string& text) {
+        return count(text.begin(), text.end(), '\n');
+    };
+    assert(count_lines(GetFileContents("shape/replay.in"s)) == count_lines(GetFileContents("shape/real.in"s)));
+
+    // Форма воспроизведённого дерева совпадает с исходной вплоть до размеров файлов
+    assert(CaptureGraphShape(replay->input_file, replay->include_dirs, "shape"_p / "replay.shape"_p));
+    auto strip_sizes = [](const string& text) {
+        istringstream in(text);
+        string result;
+        string line;
+        while (getline(in, line)) {
+            if (line.rfind("file ", 0) == 0) {
+                line = line.substr(0, line.rfind(' '));
+            }
+            result += line + '\n';
+        }
+        return result;
+    };
+    assert(strip_sizes(GetFileContents("shape/replay.shape"s)) == strip_sizes(shape));
+}
+
+/**
+ * Счётчики системных вызовов чтения и записи процесса из /proc/self/io
+ */
+struct IoSyscalls {
+    bool available = false;
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+};
+
+IoSyscalls ReadIoSyscalls() {
+    IoSyscalls result;
+    ifstream io("/proc/self/io");
+    string key;
+    uint64_t value;
+    while (io >> key >> value) {
+        if (key == "syscr:") {
+            result.reads = value;
+            result.available = true;
+        } else if (key == "syscw:") {
+            result.writes = value;
+        }
+    }
+    return result;
+}
+
+/**
+ * Прогоняет сценарий тестов производительности и измеряет его метрики
+ * (имена без сценария). Число инструкций измеряется, только если доступны
+ * аппаратные счётчики, системные вызовы - если есть /proc/self/io
+ *
+ * @return метрики или nullopt, если обработка не удалась
+ */
+optional<map<string, uint64_t>> MeasurePerfScenario(const BenchTree& tree) {
+    PreprocessStats stats;
+    PreprocessOptions options;
+    options.stats = &stats;
+    const path output_file = tree.input_file.parent_path() / "out.pp"_p;
+
+    IoSyscalls before = ReadIoSyscalls();
+    if (!Preprocess(tree.input_file, output_file, tree.include_dirs, options)) {
+        return nullopt;
+    }
+    IoSyscalls after = ReadIoSyscalls();
+
+    map<string, uint64_t> metrics;
+    if (stats.hw_counters) {
+        uint64_t instructions = 0;
+        for (const auto& phase : stats.total) {
+            instructions += phase.instructions;
+        }
+        metrics["instructions"] = instructions;
+    }
+    if (after.available) {
+        metrics["read_syscalls"] = after.reads - before.reads;
+        metrics["write_syscalls"] = after.writes - before.writes;
+    }
+    metrics["files_opened"] = stats.files_opened;
+    metrics["probes"] = stats.probes;
+
+    // Заменители числа инструкций, не зависящие от машины: обработка
+    // линейна по прочитанному и выведенному тексту
+    uint64_t read_bytes = 0;
+    for (uint64_t bytes : stats.read_bytes) {
+        read_bytes += bytes;
+    }
+    metrics["read_bytes"] = read_bytes;
+    error_code err;
+    metrics["output_bytes"] = filesystem::file_size(output_file, err);
+    return metrics;
+}
+
+/**
+ * Выполняет MeasurePerfScenario в дочернем процессе
+ * Счётчики /proc/self/io общие для всех потоков процесса, а после fork в
+ * дочернем процессе есть только поток сценария: в замер не попадают
+ * системные вызовы других потоков и прошлых сценариев. Метрики передаются
+ * через канал строками "метрика значение"
+ */
+optional<map<string, uint64_t>> MeasurePerfScenarioIsolated(const BenchTree& tree) {
+#if defined(__unix__) || defined(__APPLE__)
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return MeasurePerfScenario(tree);
+    }
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return MeasurePerfScenario(tree);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        optional<map<string, uint64_t>> metrics = MeasurePerfScenario(tree);
+        string report;
+        if (metrics) {
+            for (const auto& [name, value] : *metrics) {
+                report += name + ' ' + to_string(value) + '\n';
+            }
+        }
+        for (size_t written = 0; written < report.size();) {
+            ssize_t n = write(fds[1], report.data() + written, report.size() - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            written += static_cast<size_t>(n);
+        }
+        cout.flush();
+        _exit(metrics ? 0 : 1);
+    }
+
+    close(fds[1]);
+    string report;
+    char chunk[4096];
+    ssize_t n;
+    while ((n = read(fds[0], chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR)) {
+        report.append(chunk, static_cast<size_t>(max<ssize_t>(n, 0)));
+    }
+    close(fds[0]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return nullopt;
+    }
+    map<string, uint64_t> metrics;
+    istringstream in(report);
+    string name;
+    uint64_t value;
+    while (in >> name >> value) {
+        metrics[name] = value;
+    }
+    return metrics;
+#else
+    return MeasurePerfScenario(tree);
+#endif
+}
+
+/**
+ * Тесты производительности: прогоняют фиксированный набор сценариев
+ * и сравнивают число инструкций и системных вызовов с сохранёнными базовыми
+ * значениями. Метрика считается ухудшенной, если превышает базу больше чем
+ * на допуск. Измеренная метрика без базового значения - тоже ошибка, как и
+ * метрика, помеченная в файле как недоступная (строка "сценарий метрика
+ * unavailable": база записана на машине без аппаратных счётчиков): раз она
+ * измеряется здесь, базу нужно записать на этой машине. Каждый сценарий
+ * выполняется в отдельном процессе (MeasurePerfScenarioIsolated). Кроме числа инструкций
+ * всегда измеряются детерминированные заменители работы: объём прочитанных
+ * и выведенных байт. С update = true базовые значения перезаписываются измеренными
+ *
+ * @param baselines_file - файл базовых значений: строки "сценарий метрика значение допуск_в_процентах"
+ *                         или "сценарий метрика unavailable"
+ * @param update - перезаписать базовые значения
+ * @return true, если ни одна метрика не ухудшилась
+ */
+bool RunPerfTests(const path& baselines_file, bool update) {
+    struct Baseline {
+        uint64_t value = 0;
+        double tolerance = 0;
+        bool unavailable = false; // метрику не удалось измерить при записи базы
+    };
+    map<string, Baseline> baselines;
+    {
+        ifstream in(baselines_file);
+        string line;
+        while (getline(in, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            istringstream fields(line);
+            string scenario, metric, value;
+            Baseline baseline;
+            if (!(fields >> scenario >> metric >> value)) {
+                continue;
+            }
+            if (value == "unavailable") {
+                baseline.unavailable = true;
+            } else if (!(istringstream(value) >> baseline.value) || !(fields >> baseline.tolerance)) {
+                continue;
+            }
+            baselines[scenario + ' ' + metric] = baseline;
+        }
+    }
+
+    const path root = "perf_test"_p;
+    error_code err;
+    filesystem::remove_all(root, err);
+    vector<BenchTree> trees = {
+        MakeChainTree(root / "chain"_p, 50, 50),
+        MakeFanoutTree(root / "fanout"_p, 100, 20, 20),
+        MakeDiamondTree(root / "diamond"_p, 6, 2, 20),
+    };
+
+    map<string, uint64_t> measured;
+    vector<string> unmeasured; // метрики, которые на этой машине не измерить
+    bool hw_counters = false;
+    for (const auto& tree : trees) {
+        optional<map<string, uint64_t>> metrics = MeasurePerfScenarioIsolated(tree);
+        if (!metrics) {
+            cout << tree.shape << ": preprocessing failed" << endl;
+            return false;
+        }
+        if (metrics->count("instructions") != 0) {
+            hw_counters = true;
+        } else {
+            unmeasured.push_back(tree.shape + " instructions");
+        }
+        for (const auto& [name, value] : *metrics) {
+            measured[tree.shape + ' ' + name] = value;
+        }
+    }
+    if (!hw_counters) {
+        cout << "hardware counters unavailable, instruction counts not checked" << endl;
+    }
+
+    if (update) {
+        // Допуски существующих записей сохраняются, новые получают допуск по умолчанию
+        for (const auto& [key, value] : measured) {
+            Baseline& baseline = baselines[key];
+            if (baseline.tolerance == 0) {
+                // Инструкции и их заменители почти не шумят, допуск для них строже
+                const bool precise = key.find("instructions") != string::npos || key.find("_bytes") != string::npos;
+                baseline.tolerance = precise ? 3 : 10;
+            }
+            baseline.value = value;
+            baseline.unavailable = false;
+        }
+        // Записанная ранее база неизмеримой здесь метрики остаётся как есть
+        for (const auto& key : unmeasured) {
+            if (baselines.count(key) == 0) {
+                baselines[key].unavailable = true;
+            }
+        }
+        ofstream out(baselines_file);
+        out << "# scenario metric baseline tolerance_percent\n";
+        out << "# scenario metric unavailable - not measurable where the baselines were written\n";
+        for (const auto& [key, baseline] : baselines) {
+            if (baseline.unavailable) {
+                out << key << " unavailable\n";
+            } else {
+                out << key << ' ' << baseline.value << ' ' << baseline.tolerance << '\n';
+            }
+        }
+        cout << "baselines written to " << baselines_file.string() << endl;
+        return static_cast<bool>(out);
+    }
+
+    bool success = true;
+    for (const auto& [key, value] : measured) {
+        auto it = baselines.find(key);
+        if (it == baselines.end()) {
+            cout << key << ": " << value << " MISSING BASELINE" << endl;
+            success = false;
+            continue;
+        }
+        if (it->second.unavailable) {
+            cout << key << ": " << value << " BASELINE MARKED UNAVAILABLE, but measurable here: update the baselines"
+                 << endl;
+            success = false;
+            continue;
+        }
+        const Baseline& baseline = it->second;
+        double limit = baseline.value * (1 + baseline.tolerance / 100);
+        double change = baseline.value ? 100.0 * (static_cast<double>(value) - baseline.value) / baseline.value : 0.0;
+        cout << key << ": " << value << " baseline " << baseline.value << " (" << showpos << fixed
+             << setprecision(1) << change << noshowpos << "%)";
+        if (value > limit) {
+            cout << " REGRESSION";
+            success = false;
+        } else if (value < baseline.value * (1 - baseline.tolerance / 100)) {
+            cout << " improved, consider updating the baseline";
+        }
+        cout << endl;
+    }
+    return success;
+}
+
+/**
+ * Главная функция программы
+ * Запускает тестирование препроцессора. Другие режимы:
+ *   --bench [--io-policy файл] - бенчмарк с порогами чтения из файла калибровки
+ *                                (по умолчанию io_policy.txt, если он есть)
+ *   --perf-test [файл_базы] - тесты производительности против базовых значений
+ *   --update-baselines [файл_базы] - перезапись базовых значений
+ */
+int main(int argc, char* argv[]) {
+    if (argc > 1 && argv[1] == "--bench"sv) {
+        bool cold = false;
+        path shape_file;
+        path policy_file;
+        for (int i = 2; i < argc; ++i) {
+            if (argv[i] == "--cold"sv) {
+                cold = true;
+            } else if (argv[i] == "--shape"sv && i + 1 < argc) {
+                shape_file = argv[++i];
+            } else if (argv[i] == "--io-policy"sv && i + 1 < argc) {
+                policy_file = argv[++i];
+            }
+        }
+        if (!LoadIoCalibration(policy_file.empty() ? "io_policy.txt"_p : policy_file, !policy_file.empty())) {
+            return 1;
+        }
+        RunBenchmarks(cold, shape_file);
+        return 0;
+    }
+    if (argc > 1 && argv[1] == "--calibrate-io"sv) {
+        path policy_file = argc > 2 ? path(argv[2]) : "io_policy.txt"_p;
+        IoPolicy policy = CalibrateIoPolicy("io_calibration"_p, cout);
+        error_code err;
+        filesystem::remove_all("io_calibration"_p, err);
+        return policy.Save(policy_file) ? 0 : 1;
+    }
+    if (argc > 3 && argv[1] == "--capture-shape"sv) {
+        // --capture-shape <входной файл> <файл формы> [директории include...]
+        vector<path> include_dirs(argv + 4, argv + argc);
+        return CaptureGraphShape(argv[2], include_dirs, argv[3]) ? 0 : 1;
+    }
+    if (argc > 1 && (argv[1] == "--perf-test"sv || argv[1] == "--update-baselines"sv)) {
+        path baselines_file = argc > 2 ? path(argv[2]) : "perf_baselines.txt"_p;
+        return RunPerfTests(baselines_file, argv[1] == "--update-baselines"sv) ? 0 : 1;
+    }
+
     Test();
+    TestWarmSnapshot();
+    TestPhaseStats();
+    TestIoPolicy();
+    TestDirUsage();
+    TestIncludeFilter();
+    TestNormalize();
+    TestUtf16();
+    TestLineIndex();
+    TestChunkedOutput();
+    TestBloom();
+    TestEngine();
+    TestOutputStore();
+#if defined(__unix__) || defined(__APPLE__)
+    TestStatsDump();
+#endif
+    TestGraphShape();
+#ifdef __linux__
+    TestPipeOutput();
+    TestPipeOutputOutlivesSink();
+    TestMemfdOutput();
+#endif
 }